@@ -6,36 +6,19 @@
 
 #include "drivers/interface.h"
 #include "core/ipv4.h"
+#include "core/arp.h"
+#include "core/icmp.h"
+#include "network/tcp.h"
 
-// Definimos la estructura Ethernet para poder acceder al ethertype y al payload
-struct ethernet_frame {
-    unsigned char dest_mac[6];
-    unsigned char src_mac[6];
-    unsigned short ethertype;
-    unsigned char payload[1500]; 
-} __attribute__((packed));
-
-// Variable global para que el callback pueda acceder a la IP de la NIC
+// Variable global con la NIC del programa
 nic_device_t nic;
 
-// CALLBACK DE RECEPCIÓN
-// Esta función se activa cada vez que llega CUALQUIER paquete a la tarjeta
-void received_packet(const void *data, unsigned int length) {
-    struct ethernet_frame *eth = (struct ethernet_frame *)data;
-    uint16_t type = ntohs(eth->ethertype);
-
-    // Si es un paquete IPv4 (0x0800), se lo pasamos a la capa de red
-    if (type == 0x0800) {
-        // Pasamos el puntero al payload (donde empieza la cabecera IP) 
-        // y restamos los 14 bytes de la cabecera Ethernet
-        ipv4_receive(&nic, eth->payload, length - 14);
-    } 
-    // Aquí podrías añadir: else if (type == 0x0806) { arp_receive(...); }
-}
-
 int main(int argc, char* argv[]) {
     nic_driver_t * drv = nic_get_driver();
 
+    // Interfaz por argumento (por defecto eth0)
+    snprintf(nic.name, sizeof(nic.name), "%s", argc > 1 ? argv[1] : "eth0");
+
     // 1. Inicializar la tarjeta de red (Capa física)
     if (drv->init(&nic) != STATUS_OK) {
         printf("Error: No se pudo inicializar la NIC. ¿Has usado sudo?\n");
@@ -44,14 +27,24 @@ int main(int argc, char* argv[]) {
 
     // 2. Configurar la identidad de nuestra interfaz (Capa de Red)
     // Cambia esta IP por la que quieras que tenga tu programa
-    nic.ip_address = inet_addr("192.168.72.132");
+    uint32_t ip = inet_addr("192.168.72.132");
+    drv->ioctl(&nic, NIC_IOCTL_SET_IP_ADDRESS, &ip);
+
+    // Solo subimos del kernel lo que la pila consume (ARP, ICMP y TCP a puertos en escucha)
+    int filtro = 1;
+    if (drv->ioctl(&nic, NIC_IOCTL_SET_FILTER, &filtro) != STATUS_OK) {
+        printf("Aviso: el backend no admite filtro BPF, se recibe todo el tráfico\n");
+    }
 
-    // 3. Registrar el callback para que la NIC nos avise al recibir datos
-    if (drv->ioctl(&nic, NIC_IOCTL_ADD_RX_CALLBACK, (void *)&received_packet) != STATUS_OK) {
-        printf("Error al añadir el callback de recepción\n");
+    // 3. Registrar los protocolos: cada trama va directa a su manejador por EtherType
+    //    (ARP, IPv4) y cada paquete IP al de su protocolo (ICMP, TCP)
+    if (arp_init(&nic) != STATUS_OK || ipv4_init(&nic) != STATUS_OK) {
+        printf("Error al registrar los manejadores de protocolo\n");
         drv->shutdown(&nic);
         return -1;
     }
+    icmp_init();
+    tcp_init();
 
     printf("--- STACK INICIALIZADO ---\n");
     printf("Interface: %s\n", nic.name);
@@ -73,7 +66,8 @@ int main(int argc, char* argv[]) {
     printf("\nEscuchando tráfico IP... Presiona Enter para salir.\n");
     getchar();
 
-    // 5. Cerrar todo correctamente
+    // 5. Cerrar todo correctamente (los paquetes pendientes de ARP son de la NIC)
+    arp_shutdown();
     drv->shutdown(&nic);
     printf("NIC cerrada. ¡Adiós!\n");
 
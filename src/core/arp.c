@@ -1,7 +1,10 @@
 #include "core/arp.h"
 #include "core/ethernet.h"
 #include "drivers/interface.h" 
+#include <pthread.h>
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 
@@ -21,26 +24,35 @@ struct arp_packet { //28 bytes
 
 /****************** TX Functions ******************/
 
-void arp_send_request(nic_driver_t *drv, nic_device_t *device, uint32_t target_ip) {
-    uint8_t broadcast[6] = {0xFF,0xFF,0xFF,0xFF,0xFF,0xFF};
-    
-    // Construir paquete ARP
+// Monta y envía un paquete ARP. Las IPs van en orden de red, como en el
+// paquete; tha NULL = ceros (Request)
+static void arp_send(nic_device_t *device, uint16_t oper, const uint8_t *dst_mac, const uint8_t *tha, uint32_t spa, uint32_t tpa) {
     struct arp_packet arp_data;
     arp_data.htype = htons(1);
     arp_data.ptype = htons(0x0800);
     arp_data.hlen  = 6;
     arp_data.plen  = 4;
-    arp_data.oper  = htons(ARP_REQUEST);
+    arp_data.oper  = htons(oper);
     memcpy(arp_data.sha, device->mac_address, 6);
-    arp_data.spa = htonl(device->ip_address);
-    memset(arp_data.tha, 0, 6);
-    arp_data.tpa = htonl(target_ip);
+    arp_data.spa = spa;
+    if (tha) {
+        memcpy(arp_data.tha, tha, 6);
+    } else {
+        memset(arp_data.tha, 0, 6);
+    }
+    arp_data.tpa = tpa;
 
     // Construir frame Ethernet con payload ARP
     uint8_t buf[ETH_HDR_LEN + sizeof(struct arp_packet)];
-    int frame_len = eth_make_frame(buf, broadcast, device->mac_address, ETH_TYPE_ARP, &arp_data, sizeof(struct arp_packet));
-    
-    drv->send_packet(device, buf, frame_len);
+    int frame_len = eth_make_frame(buf, (uint8_t *)dst_mac, device->mac_address, ETH_TYPE_ARP, &arp_data, sizeof(struct arp_packet));
+    nic_get_driver()->send_packet(device, buf, frame_len);
+}
+
+void arp_send_request(nic_driver_t *drv, nic_device_t *device, uint32_t target_ip) {
+    uint8_t broadcast[6] = {0xFF,0xFF,0xFF,0xFF,0xFF,0xFF};
+    (void)drv;
+    // ip_address ya está en orden de red, target_ip en orden de host
+    arp_send(device, ARP_REQUEST, broadcast, NULL, device->ip_address, htonl(target_ip));
 
     printf("[ARP] Request: Who has %d.%d.%d.%d?\n",
         (target_ip>>24)&0xFF,(target_ip>>16)&0xFF,
@@ -48,77 +60,59 @@ void arp_send_request(nic_driver_t *drv, nic_device_t *device, uint32_t target_i
 }
 
 void arp_send_reply(nic_driver_t *drv, nic_device_t *device, uint8_t *target_mac, uint32_t target_ip) {
-    uint8_t buf[ETH_HDR_LEN + sizeof(struct arp_packet)];
-    // Construir paquete ARP
-    struct arp_packet arp_data;
-    arp_data.htype = htons(1);
-    arp_data.ptype = htons(0x0800);
-    arp_data.hlen  = 6;
-    arp_data.plen  = 4;
-    arp_data.oper  = htons(ARP_REPLY);
-    memcpy(arp_data.sha, device->mac_address, 6);
-    arp_data.spa = htonl(device->ip_address);
-    memcpy(arp_data.tha, target_mac, 6);
-    arp_data.tpa = target_ip;
+    (void)drv;
+    arp_send(device, ARP_REPLY, target_mac, target_mac, device->ip_address, htonl(target_ip));
 
-    // Construir frame Ethernet con payload ARP
-    int frame_len = eth_make_frame(buf, target_mac, device->mac_address, ETH_TYPE_ARP, &arp_data, sizeof(struct arp_packet));
-    
-    drv->send_packet(device, buf, frame_len);
-
-    printf("[ARP] Reply: %d.%d.%d.%d is at %02X:%02X:%02X:%02X:%02X:%02X\n",
+    uint32_t ip = ntohl(device->ip_address);
+    printf("[ARP] Reply to %d.%d.%d.%d: %d.%d.%d.%d is at %02X:%02X:%02X:%02X:%02X:%02X\n",
         (target_ip>>24)&0xFF,(target_ip>>16)&0xFF,
         (target_ip>>8)&0xFF,target_ip&0xFF,
-        target_mac[0],target_mac[1],target_mac[2],
-        target_mac[3],target_mac[4],target_mac[5]);
+        (ip>>24)&0xFF,(ip>>16)&0xFF,(ip>>8)&0xFF,ip&0xFF,
+        device->mac_address[0],device->mac_address[1],device->mac_address[2],
+        device->mac_address[3],device->mac_address[4],device->mac_address[5]);
+}
 
-    arp_table_add(target_ip, target_mac);
+void arp_announce(nic_device_t *device) {
+    uint8_t broadcast[6] = {0xFF,0xFF,0xFF,0xFF,0xFF,0xFF};
+    if (device->ip_address == 0) {
+        return;
+    }
+    // Gratuitous ARP: Request con nuestra IP como origen y como destino
+    arp_send(device, ARP_REQUEST, broadcast, NULL, device->ip_address, device->ip_address);
 }
 
 
 /****************** RX Function ******************/
-/*
-void arp_rx(nic_device_t *nic, nic_driver_t *drv,
-            const uint8_t *frame, size_t len)
-{
-    struct arp_hdr *arp = (struct arp_hdr *)(frame + ETH_HDR_LEN);
 
-    if (ntohs(arp->oper) != ARP_REQUEST)
-        return;
-
-    if (arp->target_ip != htonl(MY_IP))
-        return;
+static int arp_table_store(uint32_t ip, const uint8_t *mac, int create);
 
-    arp_send_reply(
-        drv,
-        nic,
-        arp->sender_mac,
-        ntohl(arp->sender_ip)
-    );
-}
-*/
-void arp_rx(uint8_t *buf, unsigned int len) {
-    // 1. Usamos la constante ETH_HDR_LEN que ya tienes definida
+void arp_rx(nic_device_t *nic, const uint8_t *buf, unsigned int len) {
     if (len < ETH_HDR_LEN + sizeof(struct arp_packet)) return;
 
-    // 2. Para acceder al tipo, mapeamos la cabecera manualmente 
-    // o usamos un puntero a los offsets de la trama
     uint16_t eth_type = (buf[12] << 8) | buf[13]; // El EtherType está en los bytes 12 y 13
+    if (eth_type != ETH_P_ARP) return;
 
-    if (eth_type != 0x0806) return; // 0x0806 es el código para ARP (ETH_P_ARP)
-
-    // 3. Apuntamos al paquete ARP que empieza después de la cabecera Ethernet
-    struct arp_packet *arp = (void*)(buf + ETH_HDR_LEN);
-
+    // El paquete ARP empieza después de la cabecera Ethernet
+    const struct arp_packet *arp = (const void *)(buf + ETH_HDR_LEN);
+    if (ntohs(arp->htype) != 1 || ntohs(arp->ptype) != 0x0800 || arp->hlen != 6 || arp->plen != 4) {
+        return;
+    }
     uint16_t oper = ntohs(arp->oper);
+    uint32_t sender_ip = ntohl(arp->spa);
+    const uint8_t *sender_mac = arp->sha;
+    int for_us = nic->ip_address != 0 && arp->tpa == nic->ip_address;
 
-    // Solo procesamos Reply
-    if (oper == 0x0002) { // 0x0002 es ARP_REPLY
-        uint32_t sender_ip = ntohl(arp->spa);
-        uint8_t *sender_mac = arp->sha;
-
-        arp_table_add(sender_ip, sender_mac);
+    // Aprendizaje pasivo (RFC 826): el emisor se refresca si ya lo teníamos y
+    // se añade si el paquete iba para nosotros, que es a quien va a hablar.
+    // Un Request de sondeo (spa = 0) o con nuestra propia IP no enseña nada.
+    if (sender_ip != 0 && arp->spa != nic->ip_address) {
+        arp_table_store(sender_ip, sender_mac, for_us);
+    }
 
+    if (oper == ARP_REQUEST && for_us) {
+        // Respuesta directa desde la ráfaga de recepción
+        arp_send_reply(nic_get_driver(), nic, (uint8_t *)sender_mac, sender_ip);
+    } else if (oper == ARP_REPLY && for_us) {
         printf("[ARP RX] Reply from %d.%d.%d.%d is at %02X:%02X:%02X:%02X:%02X:%02X\n",
             (sender_ip>>24)&0xFF, (sender_ip>>16)&0xFF,
             (sender_ip>>8)&0xFF, sender_ip&0xFF,
@@ -128,48 +122,489 @@ void arp_rx(uint8_t *buf, unsigned int len) {
 }
 
 
-static arp_entry_t arp_table[ARP_TABLE_SIZE];
+// Manejador del EtherType ARP: la trama llega completa, cabecera Ethernet incluida
+static void arp_input(nic_device_t *nic, const hal_frame_t *frame) {
+    arp_rx(nic, frame->data, frame->length);
+}
+
+static int arp_timer_start(void);
+static void arp_pending_flush(uint32_t ip, const uint8_t *mac);
+
+int arp_init(nic_device_t *nic) {
+    arp_table_init();
+    if (arp_timer_start() < 0) {
+        return -1;
+    }
+    int status = nic_register_ethertype_handler(nic, ETH_P_ARP, arp_input);
+    if (status == 0) {
+        arp_announce(nic);
+    }
+    return status;
+}
+
+static arp_entry_t *arp_table = NULL;
+static unsigned int arp_table_mask = 0;        // Entradas - 1
+static unsigned int arp_table_shift = 0;       // 32 - log2(entradas)
+static pthread_mutex_t arp_lock = PTHREAD_MUTEX_INITIALIZER;   // Serializa a los escritores
+static uint32_t arp_generation = 0;            // Última generación repartida, con arp_lock
+
+static uint64_t arp_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t arp_mac_pack(const uint8_t *mac) {
+    uint64_t packed = 0;
+    for (int i = 0; i < 6; i++) {
+        packed = (packed << 8) | mac[i];
+    }
+    return packed;
+}
+
+static void arp_mac_unpack(uint64_t packed, uint8_t *mac) {
+    for (int i = 5; i >= 0; i--) {
+        mac[i] = packed & 0xFF;
+        packed >>= 8;
+    }
+}
+
+// Primera entrada de la ventana de la IP (hash multiplicativo de Fibonacci).
+// Se usan los bits altos del producto: los bajos solo dependen de los bits
+// bajos de la IP, y en una /24 dejarían casi toda la tabla sin usar.
+static arp_entry_t *arp_window(uint32_t ip) {
+    uint32_t hash = ip * 2654435761u;
+    return &arp_table[(hash >> arp_table_shift) & ~(ARP_TABLE_WAYS - 1)];
+}
+
+static int arp_age_state(uint64_t confirmed, uint64_t now) {
+    uint64_t age = now - confirmed;
+    if (age < ARP_REACHABLE_MS) {
+        return ARP_STATE_REACHABLE;
+    }
+    return age < ARP_EXPIRE_MS ? ARP_STATE_STALE : ARP_STATE_EXPIRED;
+}
+
+// Lectura consistente de una entrada: se repite mientras un escritor la toque
+static void arp_entry_read(arp_entry_t *entry, arp_entry_t *copy) {
+    uint32_t seq;
+    do {
+        while ((seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE)) & 1) {
+            // Escritor a mitad, dura unas pocas instrucciones
+        }
+        copy->ip = __atomic_load_n(&entry->ip, __ATOMIC_RELAXED);
+        copy->mac = __atomic_load_n(&entry->mac, __ATOMIC_RELAXED);
+        copy->confirmed = __atomic_load_n(&entry->confirmed, __ATOMIC_RELAXED);
+        copy->generation = __atomic_load_n(&entry->generation, __ATOMIC_RELAXED);
+        copy->in_use = __atomic_load_n(&entry->in_use, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq);
+}
+
+// Con arp_lock tomado
+static void arp_entry_write(arp_entry_t *entry, uint32_t ip, uint64_t mac, uint64_t now, int in_use) {
+    // Una confirmación de la misma MAC no invalida nada
+    uint32_t generation = entry->generation;
+    if (entry->in_use != in_use || entry->ip != ip || entry->mac != mac) {
+        if (++arp_generation == 0) {
+            arp_generation = 1;     // 0 queda para "no está"
+        }
+        generation = arp_generation;
+    }
+    uint32_t seq = entry->seq;
+    __atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&entry->ip, ip, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->mac, mac, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->confirmed, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->used, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->generation, generation, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->in_use, in_use, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int arp_table_init_size(unsigned int entries) {
+    unsigned int size = ARP_TABLE_WAYS;
+    unsigned int shift = 32 - __builtin_ctz(ARP_TABLE_WAYS);
+    while (size < entries) {
+        size <<= 1;
+        shift--;
+    }
+    arp_entry_t *table = calloc(size, sizeof(arp_entry_t));
+    if (!table) {
+        return -1;
+    }
+    free(arp_table);
+    arp_table = table;
+    arp_table_mask = size - 1;
+    arp_table_shift = shift;
+    return 0;
+}
 
 void arp_table_init(void) {
-    memset(arp_table, 0, sizeof(arp_table)); // Vacía memoria
+    if (!arp_table) {
+        arp_table_init_size(ARP_TABLE_DEFAULT_SIZE);
+        return;
+    }
+    pthread_mutex_lock(&arp_lock);
+    for (unsigned int i = 0; i <= arp_table_mask; i++) {
+        if (arp_table[i].in_use) {
+            arp_entry_write(&arp_table[i], 0, 0, 0, 0);
+        }
+    }
+    pthread_mutex_unlock(&arp_lock);
 }
 
-void arp_table_add(uint32_t ip, uint8_t *mac) {
-    for (int i = 0; i < ARP_TABLE_SIZE; i++) {
-        if (!arp_table[i].valid) {
-            arp_table[i].ip = ip;
-            memcpy(arp_table[i].mac, mac, 6);
-            arp_table[i].valid = 1;
-            return;
+void arp_table_add(uint32_t ip, const uint8_t *mac) {
+    arp_table_store(ip, mac, 1);
+}
+
+// Guarda la MAC de ip; sin create solo actualiza una entrada que ya exista.
+// 1 si la guardó, 0 si no.
+static int arp_table_store(uint32_t ip, const uint8_t *mac, int create) {
+    if (!arp_table) {
+        return 0;
+    }
+    uint64_t now = arp_now_ms();
+    arp_entry_t *window = arp_window(ip);
+    arp_entry_t *slot = NULL;
+    arp_entry_t *victim = NULL;
+    int victim_rank = -1;
+
+    // Con el cerrojo los campos no cambian bajo nuestros pies: se leen sin seqlock
+    pthread_mutex_lock(&arp_lock);
+    for (int i = 0; i < ARP_TABLE_WAYS; i++) {
+        arp_entry_t *entry = &window[i];
+        if (entry->in_use && entry->ip == ip) {
+            slot = entry;       // Ya estaba: se actualiza en su sitio
+            break;
         }
+        // Se prefiere una entrada libre, luego una caducada y si no la menos usada
+        int rank = !entry->in_use ? 2 : arp_age_state(entry->confirmed, now) == ARP_STATE_EXPIRED;
+        if (rank > victim_rank || (rank == victim_rank &&
+            __atomic_load_n(&entry->used, __ATOMIC_RELAXED) < __atomic_load_n(&victim->used, __ATOMIC_RELAXED))) {
+            victim = entry;
+            victim_rank = rank;
+        }
+    }
+    if (!slot && !create) {
+        pthread_mutex_unlock(&arp_lock);
+        return 0;
     }
-    // Si la tabla está llena, reemplaza la primera entrada (simple)
-    arp_table[0].ip = ip;
-    memcpy(arp_table[0].mac, mac, 6);
-    arp_table[0].valid = 1;
+    arp_entry_write(slot ? slot : victim, ip, arp_mac_pack(mac), now, 1);
+    pthread_mutex_unlock(&arp_lock);
+    arp_pending_flush(ip, mac);
+    return 1;
 }
 
-uint8_t *arp_table_lookup(uint32_t ip) {
-    for (int i = 0; i < ARP_TABLE_SIZE; i++) {
-        if (arp_table[i].valid && arp_table[i].ip == ip) {
-            return arp_table[i].mac;
+int arp_table_lookup(uint32_t ip, uint8_t *mac) {
+    if (!arp_table) {
+        return -1;
+    }
+    arp_entry_t *window = arp_window(ip);
+    for (int i = 0; i < ARP_TABLE_WAYS; i++) {
+        arp_entry_t *entry = &window[i];
+        if (__atomic_load_n(&entry->ip, __ATOMIC_RELAXED) != ip) {
+            continue;
+        }
+        arp_entry_t copy;
+        arp_entry_read(entry, &copy);
+        if (!copy.in_use || copy.ip != ip) {
+            continue;
+        }
+        uint64_t now = arp_now_ms();
+        if (arp_age_state(copy.confirmed, now) == ARP_STATE_EXPIRED) {
+            return -1;
         }
+        // Marca de uso para el LRU, a lo sumo una escritura por segundo
+        if (now - __atomic_load_n(&entry->used, __ATOMIC_RELAXED) >= 1000) {
+            __atomic_store_n(&entry->used, now, __ATOMIC_RELAXED);
+        }
+        arp_mac_unpack(copy.mac, mac);
+        return 0;
     }
-    return NULL;
+    return -1;
+}
+
+uint32_t arp_table_generation(uint32_t ip) {
+    if (!arp_table) {
+        return 0;
+    }
+    arp_entry_t *window = arp_window(ip);
+    for (int i = 0; i < ARP_TABLE_WAYS; i++) {
+        arp_entry_t *entry = &window[i];
+        if (__atomic_load_n(&entry->ip, __ATOMIC_RELAXED) != ip) {
+            continue;
+        }
+        arp_entry_t copy;
+        arp_entry_read(entry, &copy);
+        if (copy.in_use && copy.ip == ip) {
+            return copy.generation;
+        }
+    }
+    return 0;
+}
+
+int arp_table_state(uint32_t ip) {
+    if (!arp_table) {
+        return ARP_STATE_FREE;
+    }
+    arp_entry_t *window = arp_window(ip);
+    for (int i = 0; i < ARP_TABLE_WAYS; i++) {
+        arp_entry_t copy;
+        arp_entry_read(&window[i], &copy);
+        if (copy.in_use && copy.ip == ip) {
+            return arp_age_state(copy.confirmed, arp_now_ms());
+        }
+    }
+    return ARP_STATE_FREE;
 }
 
 void arp_table_print(void) {
+    static const char *states[] = { "free", "reachable", "stale", "expired" };
+    uint64_t now = arp_now_ms();
     printf("\nARP table:\n");
-    printf("IP address        MAC address\n");
-    printf("----------------  -----------------\n");
-    for (int i = 0; i < ARP_TABLE_SIZE; i++) {
-        if (arp_table[i].valid) {
-            uint32_t ip = arp_table[i].ip;
-            uint8_t *m = arp_table[i].mac;
-            printf("%d.%d.%d.%d     %02X:%02X:%02X:%02X:%02X:%02X\n",
+    printf("IP address        MAC address        State\n");
+    printf("----------------  -----------------  ---------\n");
+    for (unsigned int i = 0; arp_table && i <= arp_table_mask; i++) {
+        arp_entry_t copy;
+        arp_entry_read(&arp_table[i], &copy);
+        if (copy.in_use) {
+            uint32_t ip = copy.ip;
+            uint8_t m[6];
+            arp_mac_unpack(copy.mac, m);
+            printf("%3d.%3d.%3d.%3d   %02X:%02X:%02X:%02X:%02X:%02X  %s\n",
                 (ip>>24)&0xFF, (ip>>16)&0xFF,
                 (ip>>8)&0xFF, ip&0xFF,
-                m[0],m[1],m[2],m[3],m[4],m[5]);
+                m[0],m[1],m[2],m[3],m[4],m[5], states[arp_age_state(copy.confirmed, now)]);
+        }
+    }
+}
+
+/****************** Resolution queue ******************/
+
+// Vecino en resolución: los paquetes que esperan su MAC y el estado de los reintentos
+typedef struct {
+    nic_device_t *nic;          // NULL = hueco libre
+    uint32_t ip;
+    unsigned int count;
+    unsigned int retries;
+    uint64_t next_retry;        // ms (CLOCK_MONOTONIC) de la siguiente petición
+    nic_mbuf_t *mbufs[ARP_QUEUE_DEPTH];
+    hal_offload_t offloads[ARP_QUEUE_DEPTH];
+} arp_pending_t;
+
+static arp_pending_t arp_pending[ARP_PENDING_MAX];
+static unsigned int arp_pending_count = 0;     // Huecos ocupados, se lee sin cerrojo
+static pthread_mutex_t arp_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t arp_timer_cond;
+static pthread_t arp_timer;
+static int arp_timer_running = 0;
+
+static void arp_output(nic_device_t *nic, nic_mbuf_t *mbuf, const uint8_t *mac, const hal_offload_t *offload) {
+    nic_driver_t *drv = nic_get_driver();
+    if (eth_push_header(mbuf, mac, nic->mac_address, ETH_TYPE_IP) < 0) {
+        nic_mbuf_free(mbuf);
+        return;
+    }
+    drv->send_mbuf(nic, mbuf, (offload && offload->flags) ? offload : NULL);
+}
+
+// Con arp_pending_lock tomado
+static void arp_pending_release(arp_pending_t *pending) {
+    pending->nic = NULL;
+    pending->count = 0;
+    __atomic_fetch_sub(&arp_pending_count, 1, __ATOMIC_RELAXED);
+}
+
+int arp_resolve(nic_device_t *nic, uint32_t ip, uint8_t *mac, nic_mbuf_t *mbuf, const hal_offload_t *offload) {
+    if (arp_table_lookup(ip, mac) == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&arp_pending_lock);
+    arp_pending_t *pending = NULL;
+    arp_pending_t *free_slot = NULL;
+    for (int i = 0; i < ARP_PENDING_MAX; i++) {
+        if (arp_pending[i].nic == nic && arp_pending[i].ip == ip) {
+            pending = &arp_pending[i];
+            break;
+        }
+        if (!arp_pending[i].nic && !free_slot) {
+            free_slot = &arp_pending[i];
+        }
+    }
+    int first = !pending;
+    if (first && free_slot) {
+        pending = free_slot;
+        pending->nic = nic;
+        pending->ip = ip;
+        pending->count = 0;
+        pending->retries = 0;
+        pending->next_retry = arp_now_ms() + ARP_RETRY_MS;
+        __atomic_fetch_add(&arp_pending_count, 1, __ATOMIC_RELAXED);
+    }
+    // La MAC puede haber llegado después de la primera consulta, y
+    // arp_pending_flush() mira arp_pending_count sin cerrojo. Cada lado
+    // escribe lo suyo (el hueco aquí, la entrada de la tabla allí) y luego lee
+    // lo del otro con una barrera completa en medio, así que al menos uno de
+    // los dos ve al otro: o la consulta de aquí encuentra la MAC, o el flush
+    // ve el contador y espera al cerrojo para vaciar esta cola.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (arp_table_lookup(ip, mac) == 0) {
+        if (first && pending) {
+            arp_pending_release(pending);
+        }
+        pthread_mutex_unlock(&arp_pending_lock);
+        return 0;
+    }
+    if (!pending) {
+        // Sin huecos libres el paquete se pierde, pero se pregunta igual:
+        // si no, un vecino nuevo no se resolvería hasta que se liberara uno
+        pthread_mutex_unlock(&arp_pending_lock);
+        nic_mbuf_free(mbuf);
+        arp_send_request(nic_get_driver(), nic, ip);
+        return -1;
+    }
+    if (pending->count == ARP_QUEUE_DEPTH) {
+        pthread_mutex_unlock(&arp_pending_lock);
+        nic_mbuf_free(mbuf);
+        return -1;
+    }
+    pending->mbufs[pending->count] = mbuf;
+    if (offload) {
+        pending->offloads[pending->count] = *offload;
+    } else {
+        memset(&pending->offloads[pending->count], 0, sizeof(hal_offload_t));
+    }
+    pending->count++;
+    pthread_mutex_unlock(&arp_pending_lock);
+
+    // Una sola petición por vecino, los reintentos los lleva el temporizador
+    if (first) {
+        printf("[ARP] MAC desconocida para %d.%d.%d.%d, paquete en espera\n",
+            (ip>>24)&0xFF, (ip>>16)&0xFF, (ip>>8)&0xFF, ip&0xFF);
+        arp_send_request(nic_get_driver(), nic, ip);
+    }
+    return 1;
+}
+
+static void arp_pending_flush(uint32_t ip, const uint8_t *mac) {
+    // La entrada ya está escrita: la barrera la ordena antes de leer el
+    // contador (pareja de la de arp_resolve())
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&arp_pending_count, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    // Cada vecino (uno por NIC) se saca con el cerrojo y sus paquetes se
+    // envían sin él, en orden de llegada
+    for (;;) {
+        arp_pending_t ready;
+        int found = 0;
+        pthread_mutex_lock(&arp_pending_lock);
+        for (int i = 0; i < ARP_PENDING_MAX; i++) {
+            if (arp_pending[i].nic && arp_pending[i].ip == ip) {
+                ready = arp_pending[i];
+                arp_pending_release(&arp_pending[i]);
+                found = 1;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&arp_pending_lock);
+        if (!found) {
+            return;
+        }
+        for (unsigned int i = 0; i < ready.count; i++) {
+            arp_output(ready.nic, ready.mbufs[i], mac, &ready.offloads[i]);
         }
     }
-}
\ No newline at end of file
+}
+
+// Repite las peticiones sin respuesta y abandona (liberando sus paquetes) los
+// vecinos que no contestan tras ARP_MAX_RETRIES intentos
+static void *arp_timer_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&arp_pending_lock);
+    while (arp_timer_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += ARP_TIMER_TICK_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&arp_timer_cond, &arp_pending_lock, &deadline);
+
+        uint64_t now = arp_now_ms();
+        for (int i = 0; i < ARP_PENDING_MAX && arp_timer_running; i++) {
+            arp_pending_t *pending = &arp_pending[i];
+            if (!pending->nic || now < pending->next_retry) {
+                continue;
+            }
+            nic_device_t *nic = pending->nic;
+            uint32_t ip = pending->ip;
+            if (pending->retries == ARP_MAX_RETRIES) {
+                printf("[ARP] Sin respuesta de %d.%d.%d.%d, se descartan %u paquetes\n",
+                    (ip>>24)&0xFF, (ip>>16)&0xFF, (ip>>8)&0xFF, ip&0xFF, pending->count);
+                for (unsigned int j = 0; j < pending->count; j++) {
+                    nic_mbuf_free(pending->mbufs[j]);
+                }
+                arp_pending_release(pending);
+                continue;
+            }
+            pending->retries++;
+            pending->next_retry = now + ARP_RETRY_MS;
+            pthread_mutex_unlock(&arp_pending_lock);
+            arp_send_request(nic_get_driver(), nic, ip);
+            pthread_mutex_lock(&arp_pending_lock);
+        }
+    }
+    pthread_mutex_unlock(&arp_pending_lock);
+    return NULL;
+}
+
+static int arp_timer_start(void) {
+    pthread_mutex_lock(&arp_pending_lock);
+    if (arp_timer_running) {
+        pthread_mutex_unlock(&arp_pending_lock);
+        return 0;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&arp_timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    arp_timer_running = 1;
+    if (pthread_create(&arp_timer, NULL, arp_timer_thread, NULL) != 0) {
+        arp_timer_running = 0;
+        pthread_cond_destroy(&arp_timer_cond);
+        pthread_mutex_unlock(&arp_pending_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&arp_pending_lock);
+    return 0;
+}
+
+void arp_shutdown(void) {
+    pthread_mutex_lock(&arp_pending_lock);
+    if (!arp_timer_running) {
+        pthread_mutex_unlock(&arp_pending_lock);
+        return;
+    }
+    arp_timer_running = 0;
+    pthread_cond_signal(&arp_timer_cond);
+    pthread_mutex_unlock(&arp_pending_lock);
+    pthread_join(arp_timer, NULL);
+    pthread_cond_destroy(&arp_timer_cond);
+
+    pthread_mutex_lock(&arp_pending_lock);
+    for (int i = 0; i < ARP_PENDING_MAX; i++) {
+        if (arp_pending[i].nic) {
+            for (unsigned int j = 0; j < arp_pending[i].count; j++) {
+                nic_mbuf_free(arp_pending[i].mbufs[j]);
+            }
+            arp_pending_release(&arp_pending[i]);
+        }
+    }
+    pthread_mutex_unlock(&arp_pending_lock);
+}
@@ -0,0 +1,289 @@
+#include "core/checksum.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_X86 1
+#endif
+
+// Todas las versiones acumulan palabras de 32 bits en 64 bits: como
+// 2^16 = 1 (mod 2^16 - 1), sumar una palabra de 32 bits equivale a sumar sus
+// dos mitades de 16, y el acumulador no se desborda en ningún tamaño real, así
+// que los acarreos se pliegan una sola vez al final.
+
+typedef uint64_t (*csum_fn_t)(const uint8_t *data, size_t len, uint64_t acc);
+typedef uint64_t (*csum_copy_fn_t)(uint8_t *dst, const uint8_t *src, size_t len, uint64_t acc);
+
+struct csum_impl {
+    const char *name;
+    csum_fn_t sum;
+    csum_copy_fn_t copy;
+};
+
+static uint32_t csum_fold64(uint64_t acc) {
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    return (uint32_t)acc;
+}
+
+/****************** Escalar ******************/
+
+static uint64_t csum_scalar(const uint8_t *data, size_t len, uint64_t acc) {
+    while (len >= 16) {
+        uint32_t w[4];
+        memcpy(w, data, 16);
+        acc += (uint64_t)w[0] + w[1] + w[2] + w[3];
+        data += 16;
+        len -= 16;
+    }
+    while (len >= 4) {
+        uint32_t w;
+        memcpy(&w, data, 4);
+        acc += w;
+        data += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t w;
+        memcpy(&w, data, 2);
+        acc += w;
+        data += 2;
+        len -= 2;
+    }
+    if (len) {
+        // El byte impar ocupa la primera posición de una palabra rellena con 0
+        uint16_t w = 0;
+        memcpy(&w, data, 1);
+        acc += w;
+    }
+    return acc;
+}
+
+static uint64_t csum_scalar_copy(uint8_t *dst, const uint8_t *src, size_t len, uint64_t acc) {
+    while (len >= 16) {
+        uint32_t w[4];
+        memcpy(w, src, 16);
+        memcpy(dst, w, 16);
+        acc += (uint64_t)w[0] + w[1] + w[2] + w[3];
+        src += 16;
+        dst += 16;
+        len -= 16;
+    }
+    memcpy(dst, src, len);
+    return csum_scalar(src, len, acc);
+}
+
+/****************** x86: SSE2 y AVX2 ******************/
+
+#ifdef CSUM_X86
+
+// Cada vector se parte en sus palabras de 32 bits extendidas a 64 (unpack con
+// cero) y se suma en dos acumuladores de 64 bits por carril
+__attribute__((target("sse2")))
+static uint64_t csum_sse2_reduce(__m128i a, __m128i b) {
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(a, b));
+    return lanes[0] + lanes[1];
+}
+
+#define CSUM_SSE2_ADD(v) do {                                   \
+        lo = _mm_add_epi64(lo, _mm_unpacklo_epi32((v), zero));  \
+        hi = _mm_add_epi64(hi, _mm_unpackhi_epi32((v), zero));  \
+    } while (0)
+
+__attribute__((target("sse2")))
+static uint64_t csum_sse2(const uint8_t *data, size_t len, uint64_t acc) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = zero, hi = zero;
+    while (len >= 64) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)data);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(data + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(data + 32));
+        __m128i v3 = _mm_loadu_si128((const __m128i *)(data + 48));
+        CSUM_SSE2_ADD(v0);
+        CSUM_SSE2_ADD(v1);
+        CSUM_SSE2_ADD(v2);
+        CSUM_SSE2_ADD(v3);
+        data += 64;
+        len -= 64;
+    }
+    while (len >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)data);
+        CSUM_SSE2_ADD(v);
+        data += 16;
+        len -= 16;
+    }
+    return csum_scalar(data, len, acc + csum_sse2_reduce(lo, hi));
+}
+
+__attribute__((target("sse2")))
+static uint64_t csum_sse2_copy(uint8_t *dst, const uint8_t *src, size_t len, uint64_t acc) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = zero, hi = zero;
+    while (len >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, v);
+        CSUM_SSE2_ADD(v);
+        src += 16;
+        dst += 16;
+        len -= 16;
+    }
+    return csum_scalar_copy(dst, src, len, acc + csum_sse2_reduce(lo, hi));
+}
+
+__attribute__((target("avx2")))
+static uint64_t csum_avx2_reduce(__m256i a, __m256i b) {
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(a, b));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+#define CSUM_AVX2_ADD(v) do {                                       \
+        lo = _mm256_add_epi64(lo, _mm256_unpacklo_epi32((v), zero));\
+        hi = _mm256_add_epi64(hi, _mm256_unpackhi_epi32((v), zero));\
+    } while (0)
+
+__attribute__((target("avx2")))
+static uint64_t csum_avx2(const uint8_t *data, size_t len, uint64_t acc) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = zero, hi = zero;
+    while (len >= 128) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)data);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(data + 32));
+        __m256i v2 = _mm256_loadu_si256((const __m256i *)(data + 64));
+        __m256i v3 = _mm256_loadu_si256((const __m256i *)(data + 96));
+        CSUM_AVX2_ADD(v0);
+        CSUM_AVX2_ADD(v1);
+        CSUM_AVX2_ADD(v2);
+        CSUM_AVX2_ADD(v3);
+        data += 128;
+        len -= 128;
+    }
+    while (len >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)data);
+        CSUM_AVX2_ADD(v);
+        data += 32;
+        len -= 32;
+    }
+    return csum_scalar(data, len, acc + csum_avx2_reduce(lo, hi));
+}
+
+__attribute__((target("avx2")))
+static uint64_t csum_avx2_copy(uint8_t *dst, const uint8_t *src, size_t len, uint64_t acc) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = zero, hi = zero;
+    while (len >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)src);
+        _mm256_storeu_si256((__m256i *)dst, v);
+        CSUM_AVX2_ADD(v);
+        src += 32;
+        dst += 32;
+        len -= 32;
+    }
+    return csum_scalar_copy(dst, src, len, acc + csum_avx2_reduce(lo, hi));
+}
+
+#endif
+
+/****************** Selección en tiempo de ejecución ******************/
+
+static const struct csum_impl csum_impls[] = {
+    [CSUM_IMPL_SCALAR] = { "scalar", csum_scalar, csum_scalar_copy },
+#ifdef CSUM_X86
+    [CSUM_IMPL_SSE2] = { "sse2", csum_sse2, csum_sse2_copy },
+    [CSUM_IMPL_AVX2] = { "avx2", csum_avx2, csum_avx2_copy },
+#endif
+};
+
+#define CSUM_IMPL_COUNT     (sizeof(csum_impls) / sizeof(csum_impls[0]))
+
+// NULL hasta la primera suma; cualquier hilo puede resolverlo, todos llegan al mismo valor
+static const struct csum_impl *csum_current = NULL;
+
+static int csum_supported(unsigned int impl) {
+    if (impl >= CSUM_IMPL_COUNT || !csum_impls[impl].name) {
+        return 0;
+    }
+#ifdef CSUM_X86
+    __builtin_cpu_init();
+    if (impl == CSUM_IMPL_SSE2) {
+        return __builtin_cpu_supports("sse2");
+    }
+    if (impl == CSUM_IMPL_AVX2) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return 1;
+}
+
+int csum_select(unsigned int impl) {
+    if (impl == CSUM_IMPL_AUTO) {
+        impl = CSUM_IMPL_SCALAR;
+        for (unsigned int i = CSUM_IMPL_COUNT; i-- > CSUM_IMPL_SCALAR; ) {
+            if (csum_supported(i)) {
+                impl = i;
+                break;
+            }
+        }
+    } else if (!csum_supported(impl)) {
+        return -1;
+    }
+    __atomic_store_n(&csum_current, &csum_impls[impl], __ATOMIC_RELEASE);
+    return 0;
+}
+
+static const struct csum_impl *csum_get(void) {
+    const struct csum_impl *impl = __atomic_load_n(&csum_current, __ATOMIC_ACQUIRE);
+    if (!impl) {
+        csum_select(CSUM_IMPL_AUTO);
+        impl = __atomic_load_n(&csum_current, __ATOMIC_ACQUIRE);
+    }
+    return impl;
+}
+
+const char *csum_impl_name(void) {
+    return csum_get()->name;
+}
+
+/****************** API ******************/
+
+uint32_t csum_partial(const void *data, size_t len, uint32_t sum) {
+    const struct csum_impl *impl = csum_get();
+    // Las cabeceras (20 bytes) no compensan el coste de entrar en los vectores
+    if (len < 64) {
+        impl = &csum_impls[CSUM_IMPL_SCALAR];
+    }
+    return csum_fold64(impl->sum(data, len, sum));
+}
+
+uint32_t csum_partial_copy(void *dst, const void *src, size_t len, uint32_t sum) {
+    const struct csum_impl *impl = csum_get();
+    if (len < 64) {
+        impl = &csum_impls[CSUM_IMPL_SCALAR];
+    }
+    return csum_fold64(impl->copy(dst, src, len, sum));
+}
+
+uint16_t csum_fold(uint32_t sum) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+uint16_t csum(const void *data, size_t len) {
+    return csum_fold(csum_partial(data, len, 0));
+}
+
+uint16_t csum_update16(uint16_t check, uint16_t old_value, uint16_t new_value) {
+    uint32_t sum = (uint16_t)~check;
+    sum += (uint16_t)~old_value;
+    sum += new_value;
+    return csum_fold(sum);
+}
+
+uint16_t csum_update32(uint16_t check, uint32_t old_value, uint32_t new_value) {
+    uint32_t sum = (uint16_t)~check;
+    sum += (~old_value & 0xFFFF) + (~old_value >> 16);
+    sum += (new_value & 0xFFFF) + (new_value >> 16);
+    return csum_fold(sum);
+}
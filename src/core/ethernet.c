@@ -37,6 +37,26 @@ int eth_make_frame(uint8_t *buffer,
     return pos; // Retorna tamaño total
 }
 
+// Añadir la cabecera Ethernet delante de los datos, sin mover el payload
+int eth_push_header(nic_mbuf_t *mbuf,
+                    const uint8_t *dest_mac,
+                    const uint8_t *src_mac,
+                    uint16_t type) {
+
+    if (!mbuf || !dest_mac || !src_mac)
+        return -1;
+
+    uint8_t *hdr = nic_mbuf_prepend(mbuf, ETH_HDR_LEN);
+    if (!hdr)
+        return -1;
+
+    memcpy(hdr, dest_mac, ETH_MAC_LEN);
+    memcpy(hdr + ETH_MAC_LEN, src_mac, ETH_MAC_LEN);
+    uint16_t type_be = htons(type);
+    memcpy(hdr + 2 * ETH_MAC_LEN, &type_be, 2);
+    return 0;
+}
+
 // Leer un frame Ethernet
 int eth_read_frame(uint8_t *buffer,
                    int buffer_len,
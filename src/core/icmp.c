@@ -1,27 +1,21 @@
 #include "core/icmp.h"
 #include "core/ipv4.h"
+#include "core/checksum.h"
+#include "drivers/interface.h"
 #include <string.h>
 #include <stdio.h>
 #include <arpa/inet.h>
 
-// Checksum estándar de Internet (RFC 1071)
-static uint16_t icmp_calculate_checksum(void *vdata, size_t length) {
-    uint32_t sum = 0;
-    uint16_t *data = vdata;
-    while (length > 1) {
-        sum += *data++;
-        length -= 2;
-    }
-    if (length > 0) sum += *(uint8_t *)data;
-    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
-    return ~sum;
-}
-
 // --- FUNCIÓN DE ENVÍO ---
 void icmp_send(void *nic, uint32_t dst_ip, uint8_t type, uint8_t code, uint16_t id, uint16_t seq, const void *data, uint16_t data_len) {
     nic_device_t *nic_dev = (nic_device_t *)nic;
     uint16_t total_len = sizeof(icmp_hdr_t) + data_len;
-    uint8_t buffer[total_len];
+
+    // El mensaje se escribe directamente en un buffer del pool de la NIC;
+    // IPv4 y Ethernet añaden sus cabeceras en el headroom
+    nic_mbuf_t *mbuf = nic_mbuf_alloc(nic_dev->pool, total_len);
+    if (!mbuf) return;
+    uint8_t *buffer = nic_mbuf_data(mbuf);
 
     icmp_hdr_t *icmp = (icmp_hdr_t *)buffer;
     icmp->type = type;
@@ -31,15 +25,26 @@ void icmp_send(void *nic, uint32_t dst_ip, uint8_t type, uint8_t code, uint16_t
     icmp->seq = htons(seq);
 
     // Si el ping lleva datos (payload), los copiamos después de la cabecera
+    // sumándolos en la misma pasada; la cabecera se suma después, con el
+    // checksum aún a 0
+    uint32_t sum = 0;
     if (data && data_len > 0) {
-        memcpy(buffer + sizeof(icmp_hdr_t), data, data_len);
+        sum = csum_partial_copy(buffer + sizeof(icmp_hdr_t), data, data_len, 0);
     }
-
-    // Calculamos el checksum sobre la cabecera + los datos
-    icmp->checksum = icmp_calculate_checksum(buffer, total_len);
+    icmp->checksum = csum_fold(csum_partial(buffer, sizeof(icmp_hdr_t), sum));
 
     // Bajamos a la capa de red (IPv4). El protocolo 1 es ICMP.
-    ipv4_send(nic_dev, dst_ip, 1, buffer, total_len);
+    ipv4_send_mbuf(nic_dev, dst_ip, 1, mbuf, NULL);
+}
+
+// Manejador del protocolo 1 para la tabla de IPv4. El checksum solo se
+// recalcula si nadie lo ha comprobado antes
+static void icmp_input(nic_device_t *nic, uint32_t src_ip, const void *payload, uint16_t len, unsigned int flags) {
+    if (!(flags & (HAL_FRAME_CSUM_VALID | HAL_FRAME_CSUM_PARTIAL)) &&
+        csum(payload, len) != 0) {
+        return;
+    }
+    icmp_receive(nic, src_ip, payload, len);
 }
 
 // --- FUNCIÓN DE RECEPCIÓN ---
@@ -71,4 +76,9 @@ void icmp_receive(void *nic, uint32_t src_ip, const void *payload, uint16_t len)
     else if (request->type == ICMP_TYPE_ECHO_REPLY) {
         printf("[ICMP] Echo Reply recibido de un host remoto.\n");
     }
-}
\ No newline at end of file
+}
+
+// Registra ICMP en la tabla de protocolos de IPv4 (protocolo 1)
+void icmp_init(void) {
+    ipv4_register_protocol_handler(1, icmp_input);
+}
@@ -3,10 +3,13 @@
 #include "drivers/interface.h"
 #include "core/icmp.h"
 #include "core/arp.h"
+#include "core/checksum.h"
 #include "network/tcp.h"  // <--- MODIFICACION: Incluir cabecera TCP
 #include <arpa/inet.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 
 
@@ -16,50 +19,99 @@
  * Se utiliza para verificar la integridad de la cabecera en la recepción.
  */
 uint16_t ipv4_checksum(void *vdata, size_t length) {
-    uint32_t sum = 0;
-    uint16_t *data = vdata;
-    
-    while (length > 1) {
-        sum += *data++;
-        length -= 2;
-    }
-    if (length > 0) {
-        sum += *(uint8_t *)data;
-    }
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
-    }
-    return ~sum;
+    return csum(vdata, length);
 }
 
 
 
-void ipv4_send(nic_device_t *nic, uint32_t dst_ip, uint8_t protocol, const void *data, uint16_t data_len) {
-    nic_driver_t *drv = nic_get_driver();
+// Manejadores de la capa de transporte, indexados directamente por el campo protocolo
+static ipv4_protocol_handler_t ipv4_protocols[256];
+
+void ipv4_register_protocol_handler(uint8_t protocol, ipv4_protocol_handler_t handler) {
+    __atomic_store_n(&ipv4_protocols[protocol], handler, __ATOMIC_RELEASE);
+}
+
+/**
+ * Manejador del EtherType IPv4: quita la cabecera Ethernet y sube el paquete
+ * junto con lo que el kernel sabe de sus checksums.
+ */
+static void ipv4_input(nic_device_t *nic, const hal_frame_t *frame) {
+    if (frame->length < 14 + sizeof(struct ipv4_header)) {
+        return;
+    }
+    ipv4_receive_flags(nic, (const uint8_t *)frame->data + 14, frame->length - 14, frame->flags);
+}
 
-    // Convertimos a orden de host para la tabla ARP y para debug
-    uint32_t dst_ip_h = ntohl(dst_ip);
+int ipv4_init(nic_device_t *nic) {
+    return nic_register_ethertype_handler(nic, ETH_P_IP, ipv4_input);
+}
 
-    // 1. Intentar obtener la MAC de destino mediante la tabla ARP
-    uint8_t *dst_mac = arp_table_lookup(dst_ip_h);
+void ipv4_send(nic_device_t *nic, uint32_t dst_ip, uint8_t protocol, const void *data, uint16_t data_len) {
+    ipv4_send_offload(nic, dst_ip, protocol, data, data_len, NULL);
+}
 
-    if (dst_mac == NULL) {
-        struct in_addr a; a.s_addr = dst_ip;
-        printf("[IPv4] MAC desconocida para %s, enviando ARP Request...\n", inet_ntoa(a));
-        arp_send_request(drv, nic, dst_ip_h);
+/**
+ * Igual que ipv4_send(), pero pasando a la NIC el trabajo de checksum/segmentación.
+ * Los offsets de l4_offload son relativos al inicio de la cabecera de transporte
+ * (data); aquí se desplazan al inicio del frame Ethernet.
+ */
+void ipv4_send_offload(nic_device_t *nic, uint32_t dst_ip, uint8_t protocol, const void *data, uint16_t data_len,
+                       const hal_offload_t *l4_offload) {
+    // Única copia de los datos: al buffer que acabará en el anillo de TX
+    nic_mbuf_t *mbuf = nic_mbuf_alloc(nic->pool, data_len);
+    if (!mbuf) {
         return;
     }
+    if (data && data_len > 0) {
+        memcpy(nic_mbuf_data(mbuf), data, data_len);
+    }
+    ipv4_send_mbuf(nic, dst_ip, protocol, mbuf, l4_offload);
+}
+
+/*
+ * Caché de destinos: para cada (NIC, IP destino, protocolo) guarda las
+ * cabeceras Ethernet + IPv4 ya montadas, con total_length e identification a 0
+ * y el checksum calculado así. Enviar es copiar la plantilla y corregir el
+ * checksum de forma incremental con esos dos campos.
+ *
+ * Cada entrada lleva un seqlock como las de ARP: los emisores la leen sin
+ * cerrojos y solo quien la rellena (tras un fallo) toma ipv4_dst_lock.
+ * Una plantilla deja de valer cuando cambia la generación de la entrada ARP
+ * de su destino (no la de otros vecinos), la IP o la MAC de la NIC, y cada
+ * IPV4_DST_REVALIDATE_MS se vuelve a consultar ARP para que la entrada no
+ * caduque ni salga por LRU mientras se usa.
+ */
+typedef struct {
+    uint32_t seq;
+    uint32_t dst_ip;            // Orden de red
+    uint32_t arp_generation;    // De la entrada ARP de dst_ip
+    uint8_t  protocol;
+    nic_device_t *nic;          // NULL = libre
+    uint64_t checked;           // ms de la última consulta a ARP
+    uint64_t header[IPV4_DST_HDR_WORDS];
+} ipv4_dst_entry_t;
 
-    // 2. Construir cabecera IPv4 + datos
-    uint16_t ip_len = sizeof(struct ipv4_header) + data_len;
-    uint8_t ip_payload[ip_len];
-    struct ipv4_header *ip = (void*)ip_payload;
+static ipv4_dst_entry_t ipv4_dst_cache[IPV4_DST_CACHE_SIZE];
+static pthread_mutex_t ipv4_dst_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint16_t ipv4_next_id = 0;
+
+static uint64_t ipv4_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static ipv4_dst_entry_t *ipv4_dst_slot(nic_device_t *nic, uint32_t dst_ip, uint8_t protocol) {
+    uint32_t hash = (dst_ip ^ protocol ^ (uint32_t)(uintptr_t)nic) * 2654435761u;
+    return &ipv4_dst_cache[(hash >> 16) & (IPV4_DST_CACHE_SIZE - 1)];
+}
 
-    // 3. Rellenar Header IPv4
+// Cabecera IPv4 de plantilla: total_length e identification a 0
+static void ipv4_header_build(struct ipv4_header *ip, nic_device_t *nic, uint32_t dst_ip, uint8_t protocol) {
     ip->version_ihl = (4 << 4) | (sizeof(struct ipv4_header) / 4);
     ip->type_of_service = 0;
-    ip->total_length = htons(ip_len);
-    ip->identification = htons(0);
+    ip->total_length = 0;
+    ip->identification = 0;
     ip->flags_fragment_offset = htons(0);
     ip->time_to_live = 64;
     ip->protocol = protocol;
@@ -67,27 +119,171 @@ void ipv4_send(nic_device_t *nic, uint32_t dst_ip, uint8_t protocol, const void
     ip->source_address = nic->ip_address; // ya en network order
     ip->destination_address = dst_ip;    // ya en network order
     ip->header_checksum = ipv4_checksum(ip, sizeof(struct ipv4_header));
+}
 
-    // 4. Copiar Payload (ICMP, TCP, etc.) al buffer de payload
-    if (data && data_len > 0) {
-        memcpy(ip_payload + sizeof(struct ipv4_header), data, data_len);
+// Rellena longitud e ID en una cabecera de plantilla (RFC 1624): los dos
+// campos son contiguos y valían 0
+static void ipv4_header_finish(struct ipv4_header *ip, uint16_t total_length, uint16_t id) {
+    uint32_t fields;
+    ip->total_length = htons(total_length);
+    ip->identification = htons(id);
+    memcpy(&fields, &ip->total_length, sizeof(fields));
+    ip->header_checksum = csum_update32(ip->header_checksum, 0, fields);
+}
+
+// Copia en header la plantilla de (nic, dst_ip, protocol). 0 si sigue valiendo
+static int ipv4_dst_lookup(nic_device_t *nic, uint32_t dst_ip, uint8_t protocol, uint64_t *header) {
+    ipv4_dst_entry_t *entry = ipv4_dst_slot(nic, dst_ip, protocol);
+    uint32_t generation = arp_table_generation(ntohl(dst_ip));
+    if (generation == 0) {
+        return -1;
     }
+    uint64_t checked;
+    uint32_t seq;
+    do {
+        while ((seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE)) & 1) {
+            // Escritor a mitad
+        }
+        if (__atomic_load_n(&entry->nic, __ATOMIC_RELAXED) != nic ||
+            __atomic_load_n(&entry->dst_ip, __ATOMIC_RELAXED) != dst_ip ||
+            __atomic_load_n(&entry->protocol, __ATOMIC_RELAXED) != protocol ||
+            __atomic_load_n(&entry->arp_generation, __ATOMIC_RELAXED) != generation) {
+            return -1;
+        }
+        checked = __atomic_load_n(&entry->checked, __ATOMIC_RELAXED);
+        for (int i = 0; i < IPV4_DST_HDR_WORDS; i++) {
+            header[i] = __atomic_load_n(&entry->header[i], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq);
 
-    // 5. Construir frame Ethernet con payload IPv4 usando la utilidad ethernet
-    uint8_t buf[ETH_HDR_LEN + ip_len];
-    int frame_len = eth_make_frame(buf, dst_mac, nic->mac_address, ETH_TYPE_IP, ip_payload, ip_len);
+    // La NIC pudo cambiar de IP o de MAC (ioctl) después de montar la plantilla
+    const uint8_t *frame = (const uint8_t *)header;
+    const struct ipv4_header *ip = (const struct ipv4_header *)(frame + ETH_HDR_LEN);
+    if (ip->source_address != nic->ip_address || memcmp(frame + ETH_MAC_LEN, nic->mac_address, ETH_MAC_LEN) != 0) {
+        return -1;
+    }
 
-    // 6. Enviar al driver
-    drv->send_packet(nic, buf, frame_len);
+    uint64_t now = ipv4_now_ms();
+    if (now - checked >= IPV4_DST_REVALIDATE_MS) {
+        uint8_t mac[6];
+        if (arp_table_lookup(ntohl(dst_ip), mac) != 0 || memcmp(mac, frame, ETH_MAC_LEN) != 0) {
+            return -1;
+        }
+        __atomic_store_n(&entry->checked, now, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// Guarda la plantilla tras un envío por el camino lento. generation es la de
+// la entrada ARP de dst_ip leída antes de resolver dst_mac
+static void ipv4_dst_store(nic_device_t *nic, uint32_t dst_ip, uint8_t protocol, const uint8_t *dst_mac,
+                           uint32_t generation) {
+    uint64_t header[IPV4_DST_HDR_WORDS];
+    uint8_t *frame = (uint8_t *)header;
+    memset(header, 0, sizeof(header));
+    memcpy(frame, dst_mac, ETH_MAC_LEN);
+    memcpy(frame + ETH_MAC_LEN, nic->mac_address, ETH_MAC_LEN);
+    uint16_t type_be = htons(ETH_TYPE_IP);
+    memcpy(frame + 2 * ETH_MAC_LEN, &type_be, 2);
+    ipv4_header_build((struct ipv4_header *)(frame + ETH_HDR_LEN), nic, dst_ip, protocol);
+
+    // Es solo una caché: si otro hilo está escribiendo no se espera
+    if (pthread_mutex_trylock(&ipv4_dst_lock) != 0) {
+        return;
+    }
+    ipv4_dst_entry_t *entry = ipv4_dst_slot(nic, dst_ip, protocol);
+    uint32_t seq = entry->seq;
+    __atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&entry->nic, nic, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->dst_ip, dst_ip, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->protocol, protocol, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->arp_generation, generation, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->checked, ipv4_now_ms(), __ATOMIC_RELAXED);
+    for (int i = 0; i < IPV4_DST_HDR_WORDS; i++) {
+        __atomic_store_n(&entry->header[i], header[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ipv4_dst_lock);
+}
+
+/**
+ * Envío sin copias: mbuf contiene el segmento de transporte y las cabeceras IPv4
+ * y Ethernet se escriben en su headroom. El frame pasa a la NIC por referencia;
+ * el mbuf deja de ser nuestro en cualquier caso (también si hay error).
+ */
+void ipv4_send_mbuf(nic_device_t *nic, uint32_t dst_ip, uint8_t protocol, nic_mbuf_t *mbuf,
+                    const hal_offload_t *l4_offload) {
+    nic_driver_t *drv = nic_get_driver();
+    uint16_t ip_len = sizeof(struct ipv4_header) + mbuf->length;
+    uint16_t id = __atomic_fetch_add(&ipv4_next_id, 1, __ATOMIC_RELAXED);
+
+    // 1. Offload relativo a la trama Ethernet completa
+    hal_offload_t offload;
+    memset(&offload, 0, sizeof(offload));
+    if (l4_offload && l4_offload->flags) {
+        uint16_t l2l3_len = ETH_HDR_LEN + sizeof(struct ipv4_header);
+        offload = *l4_offload;
+        offload.csum_start += l2l3_len;
+        offload.hdr_len += l2l3_len;
+    }
+
+    // 2. Camino rápido: plantilla de la caché de destinos
+    uint64_t header[IPV4_DST_HDR_WORDS];
+    if (ipv4_dst_lookup(nic, dst_ip, protocol, header) == 0) {
+        uint8_t *frame = nic_mbuf_prepend(mbuf, IPV4_DST_HDR_LEN);
+        if (!frame) {
+            nic_mbuf_free(mbuf);
+            return;
+        }
+        memcpy(frame, header, IPV4_DST_HDR_LEN);
+        ipv4_header_finish((struct ipv4_header *)(frame + ETH_HDR_LEN), ip_len, id);
+        drv->send_mbuf(nic, mbuf, offload.flags ? &offload : NULL);
+        return;
+    }
+
+    // 3. Cabecera IPv4 delante del payload, en el headroom
+    struct ipv4_header *ip = nic_mbuf_prepend(mbuf, sizeof(struct ipv4_header));
+    if (!ip) {
+        nic_mbuf_free(mbuf);
+        return;
+    }
+    ipv4_header_build(ip, nic, dst_ip, protocol);
+    ipv4_header_finish(ip, ip_len, id);
+
+    // 4. MAC de destino: si no está en la caché, ARP guarda el paquete y lo
+    //    envía en cuanto llegue la respuesta
+    uint32_t generation = arp_table_generation(ntohl(dst_ip));
+    uint8_t dst_mac[6];
+    if (arp_resolve(nic, ntohl(dst_ip), dst_mac, mbuf, &offload) != 0) {
+        return;
+    }
+
+    // 5. Cabecera Ethernet delante de la IPv4
+    if (eth_push_header(mbuf, dst_mac, nic->mac_address, ETH_TYPE_IP) < 0) {
+        nic_mbuf_free(mbuf);
+        return;
+    }
+    if (generation != 0) {
+        ipv4_dst_store(nic, dst_ip, protocol, dst_mac, generation);
+    }
+
+    // 6. Entregar el frame al driver por referencia
+    drv->send_mbuf(nic, mbuf, offload.flags ? &offload : NULL);
 }
 /**
  * Procesa un paquete IPv4 entrante recibido desde la capa Ethernet.
  */
 void ipv4_receive(nic_device_t *nic, const void *packet, unsigned int len) {
+    ipv4_receive_flags(nic, packet, len, 0);
+}
+
+void ipv4_receive_flags(nic_device_t *nic, const void *packet, unsigned int len, unsigned int flags) {
     struct ipv4_header *hdr = (struct ipv4_header *)packet;
 
-    // 1. Validar integridad de la cabecera
-    if (ipv4_checksum(hdr, sizeof(struct ipv4_header)) != 0) {
+    // 1. Validar integridad de la cabecera, salvo si el kernel o la NIC ya lo hicieron
+    if (!(flags & HAL_FRAME_CSUM_VALID) && ipv4_checksum(hdr, sizeof(struct ipv4_header)) != 0) {
         return; 
     }
 
@@ -101,22 +297,12 @@ void ipv4_receive(nic_device_t *nic, const void *packet, unsigned int len) {
     unsigned char *payload = (unsigned char *)packet + ip_hdr_len;
     uint16_t payload_len = ntohs(hdr->total_length) - ip_hdr_len;
 
-    // 4. Multiplexación: Derivar según el protocolo de la capa de transporte
-    if (hdr->protocol == 1) { 
-        // Protocolo ICMP
-        icmp_receive(nic, hdr->source_address, payload, payload_len);
-
-    /****************************************************************************
-     * INICIO DE LA MODIFICACION: Integración de la capa TCP
-     ****************************************************************************/
-    } else if (hdr->protocol == 6) { // El protocolo 6 es TCP
-        tcp_input(nic, hdr->source_address, payload, payload_len);
-    /****************************************************************************
-     * FIN DE LA MODIFICACION
-     ****************************************************************************/
-
+    // 4. Multiplexación: una consulta a la tabla de protocolos, sin cadena de comparaciones
+    ipv4_protocol_handler_t handler = __atomic_load_n(&ipv4_protocols[hdr->protocol], __ATOMIC_ACQUIRE);
+    if (handler) {
+        handler(nic, hdr->source_address, payload, payload_len, flags);
     } else {
-        // Otros protocolos (TCP/UDP/Experimental)
+        // Protocolos sin manejador registrado (UDP/Experimental)
         struct in_addr src_addr;
         src_addr.s_addr = hdr->source_address;
 
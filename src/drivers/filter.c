@@ -0,0 +1,157 @@
+#include <linux/filter.h>
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "drivers/filter.h"
+
+#define __FILTER_SNAPLEN        0x40000     // Accept the whole frame
+#define __FILTER_ETH_TYPE       12
+#define __FILTER_IP_FRAG        20
+#define __FILTER_IP_PROTO       23
+#define __FILTER_IP_DST         30
+#define __FILTER_IP_HDR         14
+
+// Forward-only label assembler: jumps name a label, resolved once the
+// program is complete. Classic BPF conditional offsets are 8 bits, which is
+// plenty for NIC_FILTER_MAX_INSNS.
+enum {
+    __L_NEXT = 0,           // Fall through to the next instruction
+    __L_MAC_HI,
+    __L_BCAST,
+    __L_BCAST_HI,
+    __L_TYPE,
+    __L_IP,
+    __L_IP_BCAST,
+    __L_PROTO,
+    __L_TCP,
+    __L_ACCEPT,
+    __L_DROP,
+    __L_COUNT
+};
+
+struct filter_asm {
+    hal_filter_insn_t *prog;
+    unsigned int max;
+    unsigned int count;
+    int labels[__L_COUNT];
+    unsigned char jt[NIC_FILTER_MAX_INSNS];
+    unsigned char jf[NIC_FILTER_MAX_INSNS];
+    int overflow;
+};
+
+static void __filter_emit(struct filter_asm *a, uint16_t code, uint32_t k, int jt, int jf) {
+    if (a->count >= a->max || a->count >= NIC_FILTER_MAX_INSNS) {
+        a->overflow = 1;
+        return;
+    }
+    hal_filter_insn_t *insn = &a->prog[a->count];
+    insn->code = code;
+    insn->k = k;
+    insn->jt = 0;
+    insn->jf = 0;
+    a->jt[a->count] = jt;
+    a->jf[a->count] = jf;
+    a->count++;
+}
+
+static void __filter_label(struct filter_asm *a, int label) {
+    a->labels[label] = a->count;
+}
+
+static int __filter_resolve(struct filter_asm *a) {
+    for (unsigned int i = 0; i < a->count; i++) {
+        int targets[2] = { a->jt[i], a->jf[i] };
+        uint8_t *fields[2] = { &a->prog[i].jt, &a->prog[i].jf };
+        for (int j = 0; j < 2; j++) {
+            if (targets[j] == __L_NEXT) {
+                continue;
+            }
+            int offset = a->labels[targets[j]] - (int)i - 1;
+            if (a->labels[targets[j]] < 0 || offset < 0 || offset > 255) {
+                return -1;
+            }
+            if (BPF_OP(a->prog[i].code) == BPF_JA) {
+                a->prog[i].k = offset;
+            } else {
+                *fields[j] = offset;
+            }
+        }
+    }
+    return 0;
+}
+
+unsigned int nic_filter_build(const nic_filter_t *filter, hal_filter_insn_t *prog, unsigned int max_insns) {
+    if (!filter || !prog || filter->port_count > NIC_FILTER_MAX_PORTS) {
+        return 0;
+    }
+    struct filter_asm a;
+    memset(&a, 0, sizeof(a));
+    a.prog = prog;
+    a.max = max_insns;
+    for (int i = 0; i < __L_COUNT; i++) {
+        a.labels[i] = -1;
+    }
+
+    // 1. Destination MAC: ours or broadcast
+    if (!filter->promiscuous) {
+        const unsigned char *m = filter->mac;
+        uint32_t mac_lo = ((uint32_t)m[2] << 24) | ((uint32_t)m[3] << 16) | ((uint32_t)m[4] << 8) | m[5];
+        uint32_t mac_hi = ((uint32_t)m[0] << 8) | m[1];
+        __filter_emit(&a, BPF_LD | BPF_W | BPF_ABS, 2, __L_NEXT, __L_NEXT);
+        __filter_emit(&a, BPF_JMP | BPF_JEQ | BPF_K, mac_lo, __L_MAC_HI, __L_BCAST);
+        __filter_label(&a, __L_MAC_HI);
+        __filter_emit(&a, BPF_LD | BPF_H | BPF_ABS, 0, __L_NEXT, __L_NEXT);
+        __filter_emit(&a, BPF_JMP | BPF_JEQ | BPF_K, mac_hi, __L_TYPE, __L_DROP);
+        __filter_label(&a, __L_BCAST);
+        __filter_emit(&a, BPF_JMP | BPF_JEQ | BPF_K, 0xffffffff, __L_BCAST_HI, __L_DROP);
+        __filter_label(&a, __L_BCAST_HI);
+        __filter_emit(&a, BPF_LD | BPF_H | BPF_ABS, 0, __L_NEXT, __L_NEXT);
+        __filter_emit(&a, BPF_JMP | BPF_JEQ | BPF_K, 0xffff, __L_TYPE, __L_DROP);
+    }
+
+    // 2. EtherType: ARP goes up as is, IPv4 is looked at further
+    __filter_label(&a, __L_TYPE);
+    __filter_emit(&a, BPF_LD | BPF_H | BPF_ABS, __FILTER_ETH_TYPE, __L_NEXT, __L_NEXT);
+    __filter_emit(&a, BPF_JMP | BPF_JEQ | BPF_K, 0x0806, __L_ACCEPT, __L_NEXT);
+    __filter_emit(&a, BPF_JMP | BPF_JEQ | BPF_K, 0x0800, __L_IP, __L_DROP);
+
+    // 3. IPv4 destination: our address or limited broadcast
+    __filter_label(&a, __L_IP);
+    if (filter->ip_address) {
+        __filter_emit(&a, BPF_LD | BPF_W | BPF_ABS, __FILTER_IP_DST, __L_NEXT, __L_NEXT);
+        __filter_emit(&a, BPF_JMP | BPF_JEQ | BPF_K, ntohl(filter->ip_address), __L_PROTO, __L_IP_BCAST);
+        __filter_label(&a, __L_IP_BCAST);
+        __filter_emit(&a, BPF_JMP | BPF_JEQ | BPF_K, 0xffffffff, __L_PROTO, __L_DROP);
+    }
+
+    // 4. Protocols with a consumer: ICMP, and TCP to a listening port
+    __filter_label(&a, __L_PROTO);
+    __filter_emit(&a, BPF_LD | BPF_B | BPF_ABS, __FILTER_IP_PROTO, __L_NEXT, __L_NEXT);
+    __filter_emit(&a, BPF_JMP | BPF_JEQ | BPF_K, 1, __L_ACCEPT, __L_NEXT);
+    __filter_emit(&a, BPF_JMP | BPF_JEQ | BPF_K, 6, __L_TCP, __L_DROP);
+
+    __filter_label(&a, __L_TCP);
+    if (filter->port_count == 0) {
+        __filter_emit(&a, BPF_JMP | BPF_JA, 0, __L_DROP, __L_DROP);
+    } else {
+        // Non-first fragments carry no ports, let them through
+        __filter_emit(&a, BPF_LD | BPF_H | BPF_ABS, __FILTER_IP_FRAG, __L_NEXT, __L_NEXT);
+        __filter_emit(&a, BPF_JMP | BPF_JSET | BPF_K, 0x1fff, __L_ACCEPT, __L_NEXT);
+        __filter_emit(&a, BPF_LDX | BPF_B | BPF_MSH, __FILTER_IP_HDR, __L_NEXT, __L_NEXT);
+        __filter_emit(&a, BPF_LD | BPF_H | BPF_IND, __FILTER_IP_HDR + 2, __L_NEXT, __L_NEXT);
+        for (unsigned int i = 0; i < filter->port_count; i++) {
+            int miss = (i + 1 == filter->port_count) ? __L_DROP : __L_NEXT;
+            __filter_emit(&a, BPF_JMP | BPF_JEQ | BPF_K, filter->tcp_ports[i], __L_ACCEPT, miss);
+        }
+    }
+
+    __filter_label(&a, __L_ACCEPT);
+    __filter_emit(&a, BPF_RET | BPF_K, __FILTER_SNAPLEN, __L_NEXT, __L_NEXT);
+    __filter_label(&a, __L_DROP);
+    __filter_emit(&a, BPF_RET | BPF_K, 0, __L_NEXT, __L_NEXT);
+
+    if (a.overflow || __filter_resolve(&a) < 0) {
+        return 0;
+    }
+    return a.count;
+}
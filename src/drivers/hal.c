@@ -1,89 +1,246 @@
-#include <sys/ioctl.h>
-#include <net/if.h>
-#include <arpa/inet.h>
-#include <linux/if_packet.h>
-#include <net/ethernet.h>
 #include <string.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <stdio.h>
 
 #include "drivers/hal.h"
 
-struct device_handle {
-    char name[HAL_IFACE_NAMELEN];
-    int fd;
-    int index;
-    unsigned char mac[6];
-    unsigned char ip[4];
-    unsigned int mtu;
+// Generic HAL entry points. Every backend handle starts with a hal_handle_t,
+// so the backend table travels with the handle and callers never see which
+// backend they are talking to.
+#define __HAL_OPS(handle)       (((hal_handle_t *)(handle))->ops)
+
+static const hal_ops_t *__hal_backends[HAL_BACKEND_COUNT] = {
+    [HAL_BACKEND_PACKET] = &hal_packet_ops,
+    [HAL_BACKEND_XDP] = &hal_xdp_ops,
+    [HAL_BACKEND_LOOP] = &hal_loop_ops,
+    [HAL_BACKEND_TAP] = &hal_tap_ops,
 };
 
-void * hal_create_device() {
-    struct device_handle *handle = malloc(sizeof(struct device_handle));
-    if (!handle) {
-       // close(handle->fd);
+const hal_ops_t * hal_get_backend(unsigned int backend) {
+    if (backend >= HAL_BACKEND_COUNT) {
         return NULL;
     }
+    return __hal_backends[backend];
+}
 
-    struct ifreq ifr;
-    handle->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
-    if (handle->fd < 0) {
-        free(handle);
+void * hal_create_device(const hal_config_t *config) {
+    if (!config || !config->ifname[0]) {
         return NULL;
     }
-    ifr.ifr_addr.sa_family = AF_PACKET;
-    strncpy(ifr.ifr_name, HAL_IFACE_NAME, IFNAMSIZ-1);
-    ioctl(handle->fd, SIOCGIFHWADDR, &ifr);
-    memcpy(handle->mac, ifr.ifr_hwaddr.sa_data, 6);
-    ioctl(handle->fd, SIOCGIFADDR, &ifr);
-    memcpy(handle->ip, &((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr, 4);
-    ioctl(handle->fd, SIOCGIFINDEX, &ifr);
-    handle->index = ifr.ifr_ifindex;
-    strncpy(handle->name, HAL_IFACE_NAME, HAL_IFACE_NAMELEN-1);
-    ioctl(handle->fd, SIOCGIFMTU, &ifr);
-    handle->mtu = ifr.ifr_mtu;
-
-    struct sockaddr_ll sll;
-    sll.sll_family = AF_PACKET;
-    sll.sll_ifindex = handle->index;
-    sll.sll_protocol = htons(ETH_P_ALL);
-
-    if (bind(handle->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
-        close(handle->fd);
-        free(handle);
+    const hal_ops_t *ops = config->ops ? config->ops : hal_get_backend(config->backend);
+    if (!ops || !ops->create_device) {
         return NULL;
     }
-    return (void*)handle;
+    return ops->create_device(config);
 }
 
 void hal_remove_device(void *handle) {
-    struct device_handle *dev_handle = (struct device_handle *)handle;
-    if (dev_handle) {
-        close(dev_handle->fd);
-        free(dev_handle);
+    if (handle) {
+        __HAL_OPS(handle)->remove_device(handle);
     }
 }
 
+int hal_is_zero_copy(void * handle) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    return ops->is_zero_copy ? ops->is_zero_copy(handle) : 0;
+}
+
+int hal_has_tx_ring(void * handle) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    return ops->has_tx_ring ? ops->has_tx_ring(handle) : 0;
+}
+
 unsigned int hal_send(void * handle, void * data, unsigned int length) {
-    return write(((struct device_handle *)handle)->fd, data, length);
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    if (hal_has_tx_ring(handle)) {
+        // With a TX ring bound, send() only kicks the ring: go through a slot
+        unsigned int capacity = 0;
+        void *slot = hal_tx_acquire(handle, &capacity);
+        if (!slot || length > capacity) {
+            return 0;
+        }
+        memcpy(slot, data, length);
+        hal_tx_commit(handle, length);
+        return hal_tx_kick(handle, NULL) < 0 ? 0 : length;
+    }
+    return ops->send ? ops->send(handle, data, length) : 0;
 }
 
 unsigned int hal_receive(void * handle, void * buffer, unsigned int buffer_length) {
-    return read(((struct device_handle *)handle)->fd, buffer, buffer_length);
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    if (hal_is_zero_copy(handle)) {
+        // Compatibility path: copy a single frame out of the ring
+        hal_frame_t frame;
+        unsigned int length = 0;
+        if (hal_receive_zc(handle, &frame, 1) == 1) {
+            length = frame.length < buffer_length ? frame.length : buffer_length;
+            memcpy(buffer, frame.data, length);
+        }
+        hal_release_zc(handle);
+        return length;
+    }
+    return ops->receive ? ops->receive(handle, buffer, buffer_length) : 0;
+}
+
+unsigned int hal_receive_batch(void * handle, hal_frame_t *frames, unsigned int count) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    if (!frames || count == 0) {
+        return 0;
+    }
+    if (count > HAL_BATCH_MAX) {
+        count = HAL_BATCH_MAX;
+    }
+
+    if (hal_is_zero_copy(handle)) {
+        // Copying path on top of the ring for callers that own their buffers
+        hal_frame_t ring_frames[HAL_BATCH_MAX];
+        unsigned int received = hal_receive_zc(handle, ring_frames, count);
+        for (unsigned int i = 0; i < received; i++) {
+            unsigned int length = ring_frames[i].length < frames[i].length ? ring_frames[i].length : frames[i].length;
+            memcpy(frames[i].data, ring_frames[i].data, length);
+            frames[i].length = length;
+            frames[i].timestamp = ring_frames[i].timestamp;
+            frames[i].flags = ring_frames[i].flags;
+            frames[i].vlan_tci = ring_frames[i].vlan_tci;
+            frames[i].vlan_tpid = ring_frames[i].vlan_tpid;
+        }
+        hal_release_zc(handle);
+        return received;
+    }
+    return ops->receive_batch ? ops->receive_batch(handle, frames, count) : 0;
+}
+
+unsigned int hal_send_batch(void * handle, hal_frame_t *frames, unsigned int count) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    if (!frames || count == 0) {
+        return 0;
+    }
+    if (count > HAL_BATCH_MAX) {
+        count = HAL_BATCH_MAX;
+    }
+
+    if (hal_has_tx_ring(handle)) {
+        unsigned int queued = 0;
+        for (; queued < count; queued++) {
+            unsigned int capacity = 0;
+            void *slot = hal_tx_acquire(handle, &capacity);
+            if (!slot || frames[queued].length > capacity) {
+                break;
+            }
+            memcpy(slot, frames[queued].data, frames[queued].length);
+            hal_tx_commit(handle, frames[queued].length);
+        }
+        return hal_tx_kick(handle, NULL) < 0 ? 0 : queued;
+    }
+    if (ops->send_batch) {
+        return ops->send_batch(handle, frames, count);
+    }
+
+    unsigned int sent = 0;
+    while (sent < count && ops->send && ops->send(handle, frames[sent].data, frames[sent].length) == frames[sent].length) {
+        sent++;
+    }
+    return sent;
+}
+
+int hal_wait(void * handle, int timeout_ms) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    return ops->wait ? ops->wait(handle, timeout_ms) : 0;
+}
+
+unsigned int hal_receive_zc(void * handle, hal_frame_t *frames, unsigned int max_frames) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    if (!frames || !ops->receive_zc) {
+        return 0;
+    }
+    return ops->receive_zc(handle, frames, max_frames);
+}
+
+void hal_release_zc(void * handle) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    if (ops->release_zc) {
+        ops->release_zc(handle);
+    }
+}
+
+void * hal_tx_acquire(void * handle, unsigned int *capacity) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    return ops->tx_acquire ? ops->tx_acquire(handle, capacity) : NULL;
+}
+
+void hal_tx_commit(void * handle, unsigned int length) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    if (ops->tx_commit) {
+        ops->tx_commit(handle, length);
+    }
+}
+
+int hal_tx_kick(void * handle, unsigned int *failed) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    if (failed) {
+        *failed = 0;
+    }
+    return ops->tx_kick ? ops->tx_kick(handle, failed) : -1;
+}
+
+int hal_set_qdisc_bypass(void * handle, int enable) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    return ops->set_qdisc_bypass ? ops->set_qdisc_bypass(handle, enable) : -1;
 }
 
 void hal_get_mac_address(void * handle, unsigned char *mac) {
-    struct device_handle *dev_handle = (struct device_handle *)handle;
-    if (dev_handle && mac) {
-        memcpy(mac, dev_handle->mac, 6);
+    if (handle && mac) {
+        __HAL_OPS(handle)->get_mac_address(handle, mac);
     }
 }
 
 unsigned int hal_get_mtu(void * handle) {
-    struct device_handle *dev_handle = (struct device_handle *)handle;
-    if (dev_handle) {
-        return dev_handle->mtu;
+    return handle ? __HAL_OPS(handle)->get_mtu(handle) : 0;
+}
+
+unsigned int hal_get_offloads(void * handle) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    return ops->get_offloads ? ops->get_offloads(handle) : 0;
+}
+
+unsigned int hal_send_offload(void * handle, void * data, unsigned int length, const hal_offload_t *offload) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    if (!offload || offload->flags == 0) {
+        return hal_send(handle, data, length);
     }
-    return 0;
-}
\ No newline at end of file
+    // Callers only ask for what hal_get_offloads() advertised
+    if (!ops->send_offload || (offload->flags & ~hal_get_offloads(handle))) {
+        return 0;
+    }
+    return ops->send_offload(handle, data, length, offload);
+}
+
+int hal_set_filter(void * handle, const hal_filter_insn_t *prog, unsigned int length) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    return ops->set_filter ? ops->set_filter(handle, prog, length) : -1;
+}
+
+int hal_get_fd(void * handle) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    return ops->get_fd ? ops->get_fd(handle) : -1;
+}
+
+int hal_prepare_wait(void * handle) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    return ops->prepare_wait ? ops->prepare_wait(handle) : 0;
+}
+
+void hal_finish_wait(void * handle) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    if (ops->finish_wait) {
+        ops->finish_wait(handle);
+    }
+}
+
+unsigned int hal_tx_inflight(void * handle) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    return ops->tx_inflight ? ops->tx_inflight(handle) : 0;
+}
+
+int hal_set_busy_poll(void * handle, int usecs) {
+    const hal_ops_t *ops = __HAL_OPS(handle);
+    return ops->set_busy_poll ? ops->set_busy_poll(handle, usecs) : -1;
+}
@@ -0,0 +1,326 @@
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "drivers/hal.h"
+
+// In-memory loopback backend. Two devices opened with the same ifname form a
+// link: whatever one end transmits the other end receives, through a pair of
+// single-producer/single-consumer rings. No socket, no kernel, no root.
+
+#define __LOOP_CACHELINE        64
+
+typedef struct loop_slot {
+    uint8_t data[HAL_LOOP_SLOT_SIZE];
+    uint32_t length;
+} __attribute__((aligned(__LOOP_CACHELINE))) loop_slot_t;
+
+// One direction of a link. producer is written only by the transmitting end,
+// consumer only by the receiving end, each on its own cache line.
+struct loop_ring {
+    uint32_t producer __attribute__((aligned(__LOOP_CACHELINE)));
+    uint32_t consumer __attribute__((aligned(__LOOP_CACHELINE)));
+    int consumer_sleeping __attribute__((aligned(__LOOP_CACHELINE)));
+    int wake_fd;                    // eventfd, written when the consumer sleeps
+    uint32_t mask;
+    uint32_t size;
+    loop_slot_t *slots;
+};
+
+struct loop_link {
+    char name[HAL_IFACE_NAMELEN];
+    unsigned int id;
+    int open[2];                    // Which ends are currently opened
+    struct loop_ring ring[2];       // ring[i] carries frames towards end i
+    struct loop_link *next;
+};
+
+struct loop_handle {
+    hal_handle_t base;              // Must stay first, see hal.c
+    struct loop_link *link;
+    unsigned int end;
+    struct loop_ring *rx;
+    struct loop_ring *tx;
+    unsigned char mac[6];
+    uint32_t rx_taken;              // Slots handed out by receive_zc, not yet released
+    uint32_t tx_head;               // Local producer index, published by tx_kick
+    uint32_t tx_pending;            // Slots committed since the last kick
+};
+
+static pthread_mutex_t __loop_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct loop_link *__loop_links = NULL;
+static unsigned int __loop_next_id = 0;
+
+static int __loop_ring_init(struct loop_ring *ring, uint32_t size) {
+    memset(ring, 0, sizeof(struct loop_ring));
+    ring->size = size;
+    ring->mask = size - 1;
+    ring->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->wake_fd < 0) {
+        return -1;
+    }
+    if (posix_memalign((void **)&ring->slots, __LOOP_CACHELINE, sizeof(loop_slot_t) * size) != 0) {
+        ring->slots = NULL;
+        close(ring->wake_fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void __loop_ring_free(struct loop_ring *ring) {
+    if (ring->wake_fd >= 0) {
+        close(ring->wake_fd);
+    }
+    free(ring->slots);
+}
+
+static void __loop_link_free(struct loop_link *link) {
+    __loop_ring_free(&link->ring[0]);
+    __loop_ring_free(&link->ring[1]);
+    free(link);
+}
+
+// Called with __loop_lock held
+static struct loop_link * __loop_link_get(const char *name, uint32_t size) {
+    for (struct loop_link *link = __loop_links; link; link = link->next) {
+        if (strncmp(link->name, name, HAL_IFACE_NAMELEN) == 0) {
+            return link;
+        }
+    }
+
+    struct loop_link *link = malloc(sizeof(struct loop_link));
+    if (!link) {
+        return NULL;
+    }
+    memset(link, 0, sizeof(struct loop_link));
+    snprintf(link->name, HAL_IFACE_NAMELEN, "%s", name);
+    link->id = __loop_next_id++;
+    if (__loop_ring_init(&link->ring[0], size) < 0) {
+        free(link);
+        return NULL;
+    }
+    if (__loop_ring_init(&link->ring[1], size) < 0) {
+        __loop_ring_free(&link->ring[0]);
+        free(link);
+        return NULL;
+    }
+    link->next = __loop_links;
+    __loop_links = link;
+    return link;
+}
+
+static void * __loop_create_device(const hal_config_t *config) {
+    if (config->fanout_mode != HAL_FANOUT_NONE) {
+        return NULL;    // Single queue only
+    }
+    // Slots per direction, rounded up to a power of two
+    uint32_t size = 1;
+    uint32_t wanted = config->tx_frame_count ? config->tx_frame_count : HAL_LOOP_SLOT_COUNT;
+    while (size < wanted) {
+        size <<= 1;
+    }
+
+    struct loop_handle *handle = malloc(sizeof(struct loop_handle));
+    if (!handle) {
+        return NULL;
+    }
+    memset(handle, 0, sizeof(struct loop_handle));
+    handle->base.ops = &hal_loop_ops;
+
+    pthread_mutex_lock(&__loop_lock);
+    struct loop_link *link = __loop_link_get(config->ifname, size);
+    if (!link || (link->open[0] && link->open[1])) {
+        pthread_mutex_unlock(&__loop_lock);
+        free(handle);
+        return NULL;
+    }
+    handle->end = link->open[0] ? 1 : 0;
+    handle->link = link;
+    handle->rx = &link->ring[handle->end];
+    handle->tx = &link->ring[handle->end ^ 1];
+    handle->tx_head = handle->tx->producer;
+    __atomic_store_n(&link->open[handle->end], 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&__loop_lock);
+
+    // Locally administered address: link id and end
+    unsigned char mac[6] = {0x02, 0x00, 0x00, (link->id >> 8) & 0xff, link->id & 0xff, handle->end};
+    memcpy(handle->mac, mac, 6);
+    return (void *)handle;
+}
+
+static void __loop_remove_device(void *handle) {
+    struct loop_handle *loop = (struct loop_handle *)handle;
+    struct loop_link *link = loop->link;
+
+    pthread_mutex_lock(&__loop_lock);
+    __atomic_store_n(&link->open[loop->end], 0, __ATOMIC_RELEASE);
+    // Drop whatever is still queued towards us, the next opener starts clean
+    __atomic_store_n(&loop->rx->consumer, __atomic_load_n(&loop->rx->producer, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    if (!link->open[0] && !link->open[1]) {
+        struct loop_link **prev = &__loop_links;
+        while (*prev != link) {
+            prev = &(*prev)->next;
+        }
+        *prev = link->next;
+        __loop_link_free(link);
+    }
+    pthread_mutex_unlock(&__loop_lock);
+    free(loop);
+}
+
+static int __loop_is_zero_copy(void *handle) {
+    (void)handle;
+    return 1;
+}
+
+static int __loop_has_tx_ring(void *handle) {
+    (void)handle;
+    return 1;
+}
+
+static unsigned int __loop_receive_zc(void *handle, hal_frame_t *frames, unsigned int max_frames) {
+    struct loop_handle *loop = (struct loop_handle *)handle;
+    struct loop_ring *ring = loop->rx;
+    uint32_t producer = __atomic_load_n(&ring->producer, __ATOMIC_ACQUIRE);
+    uint32_t first = ring->consumer + loop->rx_taken;
+    unsigned int available = producer - first;
+    unsigned int count = available < max_frames ? available : max_frames;
+
+    for (unsigned int i = 0; i < count; i++) {
+        loop_slot_t *slot = &ring->slots[(first + i) & ring->mask];
+        frames[i].data = slot->data;
+        frames[i].length = slot->length;
+        frames[i].timestamp = 0;
+        frames[i].flags = 0;
+    }
+    loop->rx_taken += count;
+    return count;
+}
+
+static void __loop_release_zc(void *handle) {
+    struct loop_handle *loop = (struct loop_handle *)handle;
+    if (loop->rx_taken == 0) {
+        return;
+    }
+    __atomic_store_n(&loop->rx->consumer, loop->rx->consumer + loop->rx_taken, __ATOMIC_RELEASE);
+    loop->rx_taken = 0;
+}
+
+static void * __loop_tx_acquire(void *handle, unsigned int *capacity) {
+    struct loop_handle *loop = (struct loop_handle *)handle;
+    struct loop_ring *ring = loop->tx;
+    if (loop->tx_head - __atomic_load_n(&ring->consumer, __ATOMIC_ACQUIRE) >= ring->size) {
+        return NULL;
+    }
+    if (capacity) {
+        *capacity = HAL_LOOP_SLOT_SIZE;
+    }
+    return ring->slots[loop->tx_head & ring->mask].data;
+}
+
+static void __loop_tx_commit(void *handle, unsigned int length) {
+    struct loop_handle *loop = (struct loop_handle *)handle;
+    loop->tx->slots[loop->tx_head & loop->tx->mask].length = length;
+    loop->tx_head++;
+    loop->tx_pending++;
+}
+
+static int __loop_tx_kick(void *handle, unsigned int *failed) {
+    struct loop_handle *loop = (struct loop_handle *)handle;
+    struct loop_ring *ring = loop->tx;
+    unsigned int pending = loop->tx_pending;
+    loop->tx_pending = 0;
+    if (pending == 0) {
+        return 0;
+    }
+
+    // Nobody on the other end: the frames are lost, like on an unplugged cable
+    if (!__atomic_load_n(&loop->link->open[loop->end ^ 1], __ATOMIC_ACQUIRE)) {
+        loop->tx_head -= pending;
+        if (failed) {
+            *failed = pending;
+        }
+        return 0;
+    }
+
+    __atomic_store_n(&ring->producer, loop->tx_head, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->consumer_sleeping, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(ring->wake_fd, &one, sizeof(one)) < 0) {
+            // Counter saturated, the consumer is awake anyway
+        }
+    }
+    return pending;
+}
+
+static int __loop_get_fd(void *handle) {
+    return ((struct loop_handle *)handle)->rx->wake_fd;
+}
+
+static int __loop_rx_pending(struct loop_handle *loop) {
+    struct loop_ring *ring = loop->rx;
+    return __atomic_load_n(&ring->producer, __ATOMIC_SEQ_CST) != ring->consumer + loop->rx_taken;
+}
+
+static int __loop_prepare_wait(void *handle) {
+    struct loop_handle *loop = (struct loop_handle *)handle;
+    if (__loop_rx_pending(loop)) {
+        return 1;
+    }
+    // Announce we are going to sleep, then re-check so a concurrent kick is not missed
+    __atomic_store_n(&loop->rx->consumer_sleeping, 1, __ATOMIC_SEQ_CST);
+    return __loop_rx_pending(loop);
+}
+
+static void __loop_finish_wait(void *handle) {
+    struct loop_ring *ring = ((struct loop_handle *)handle)->rx;
+    __atomic_store_n(&ring->consumer_sleeping, 0, __ATOMIC_RELAXED);
+    uint64_t value;
+    if (read(ring->wake_fd, &value, sizeof(value)) < 0) {
+        // Nothing written, or already drained
+    }
+}
+
+static int __loop_wait(void *handle, int timeout_ms) {
+    struct loop_handle *loop = (struct loop_handle *)handle;
+    int ready = 1;
+    if (__loop_prepare_wait(loop) == 0) {
+        struct pollfd pfd = { .fd = loop->rx->wake_fd, .events = POLLIN };
+        ready = poll(&pfd, 1, timeout_ms);
+    }
+    __loop_finish_wait(loop);
+    return ready;
+}
+
+static void __loop_get_mac_address(void *handle, unsigned char *mac) {
+    memcpy(mac, ((struct loop_handle *)handle)->mac, 6);
+}
+
+static unsigned int __loop_get_mtu(void *handle) {
+    (void)handle;
+    return HAL_LOOP_MTU;
+}
+
+const hal_ops_t hal_loop_ops = {
+    .name = "loop",
+    .create_device = __loop_create_device,
+    .remove_device = __loop_remove_device,
+    .wait = __loop_wait,
+    .is_zero_copy = __loop_is_zero_copy,
+    .receive_zc = __loop_receive_zc,
+    .release_zc = __loop_release_zc,
+    .has_tx_ring = __loop_has_tx_ring,
+    .tx_acquire = __loop_tx_acquire,
+    .tx_commit = __loop_tx_commit,
+    .tx_kick = __loop_tx_kick,
+    .get_mac_address = __loop_get_mac_address,
+    .get_mtu = __loop_get_mtu,
+    .get_fd = __loop_get_fd,
+    .prepare_wait = __loop_prepare_wait,
+    .finish_wait = __loop_finish_wait
+};
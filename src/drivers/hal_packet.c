@@ -0,0 +1,513 @@
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <net/ethernet.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "drivers/hal.h"
+
+struct device_handle {
+    hal_handle_t base;                  // Must stay first, see hal.c
+    char name[HAL_IFACE_NAMELEN];
+    int fd;
+    int index;
+    unsigned char mac[6];
+    unsigned char ip[4];
+    unsigned int mtu;
+
+    // RX and TX rings share a single mapping, RX first
+    uint8_t *ring;
+    size_t ring_size;
+
+    // TPACKET_V3 RX ring (HAL_RX_MODE_RING only)
+    unsigned int rx_mode;
+    uint8_t *rx_ring;
+    unsigned int rx_block_size;
+    unsigned int rx_block_count;
+    unsigned int rx_block;              // Block currently being consumed
+    unsigned int rx_block_left;         // Frames left in the current block, 0 if none is open
+    unsigned int rx_blocks_pending;     // Consumed blocks not yet handed back to the kernel
+    struct tpacket3_hdr *rx_frame;      // Next frame in the current block
+
+    // TX ring (HAL_TX_MODE_RING only)
+    unsigned int tx_mode;
+    uint8_t *tx_ring;
+    unsigned int tx_frame_size;
+    unsigned int tx_frame_count;
+    unsigned int tx_head;               // Next slot to fill
+    unsigned int tx_pending;            // Slots committed since the last kick
+};
+
+// Offset of the frame data inside a TX slot, as expected by the kernel
+#define __PACKET_TX_DATA_OFFSET    TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+// TP_STATUS_* of a received frame, from its ring header or PACKET_AUXDATA
+static unsigned int __packet_frame_flags(uint32_t status) {
+    unsigned int flags = 0;
+    if (status & TP_STATUS_CSUM_VALID) {
+        flags |= HAL_FRAME_CSUM_VALID;
+    }
+    if (status & TP_STATUS_CSUMNOTREADY) {
+        flags |= HAL_FRAME_CSUM_PARTIAL;
+    }
+    if (status & TP_STATUS_VLAN_VALID) {
+        flags |= HAL_FRAME_VLAN;
+    }
+    return flags;
+}
+
+static void __packet_frame_meta(hal_frame_t *frame, uint32_t status, uint16_t tci, uint16_t tpid) {
+    frame->flags = __packet_frame_flags(status);
+    frame->vlan_tci = tci;
+    frame->vlan_tpid = (status & TP_STATUS_VLAN_TPID_VALID) ? tpid : ETH_P_8021Q;
+}
+
+static struct tpacket_block_desc * __packet_rx_block(struct device_handle *handle, unsigned int index) {
+    return (struct tpacket_block_desc *)(handle->rx_ring + (size_t)index * handle->rx_block_size);
+}
+
+static struct tpacket3_hdr * __packet_tx_slot(struct device_handle *handle, unsigned int index) {
+    return (struct tpacket3_hdr *)(handle->tx_ring + (size_t)index * handle->tx_frame_size);
+}
+
+static int __packet_setup_rings(struct device_handle *handle, const hal_config_t *config) {
+    int version = TPACKET_V3;
+    if (setsockopt(handle->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        return -1;
+    }
+
+    size_t rx_size = 0, tx_size = 0;
+    struct tpacket_req3 req;
+    if (handle->rx_mode == HAL_RX_MODE_RING) {
+        memset(&req, 0, sizeof(req));
+        req.tp_block_size = config->rx_block_size ? config->rx_block_size : HAL_RX_RING_BLOCK_SIZE;
+        req.tp_block_nr = config->rx_block_count ? config->rx_block_count : HAL_RX_RING_BLOCK_COUNT;
+        req.tp_frame_size = config->rx_frame_size ? config->rx_frame_size : HAL_RX_RING_FRAME_SIZE;
+        req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * req.tp_block_nr;
+        req.tp_retire_blk_tov = HAL_RX_RING_BLOCK_TIMEOUT_MS;
+        if (setsockopt(handle->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+            return -1;
+        }
+        handle->rx_block_size = req.tp_block_size;
+        handle->rx_block_count = req.tp_block_nr;
+        rx_size = (size_t)req.tp_block_size * req.tp_block_nr;
+    }
+    if (handle->tx_mode == HAL_TX_MODE_RING) {
+        // TX slots are fixed size, one block holds a whole number of them
+        memset(&req, 0, sizeof(req));
+        req.tp_frame_size = config->tx_frame_size ? config->tx_frame_size : HAL_TX_RING_FRAME_SIZE;
+        req.tp_frame_nr = config->tx_frame_count ? config->tx_frame_count : HAL_TX_RING_FRAME_COUNT;
+        req.tp_block_size = getpagesize();
+        while (req.tp_block_size < req.tp_frame_size) {
+            req.tp_block_size <<= 1;
+        }
+        req.tp_block_nr = req.tp_frame_nr / (req.tp_block_size / req.tp_frame_size);
+        req.tp_frame_nr = req.tp_block_nr * (req.tp_block_size / req.tp_frame_size);
+        if (setsockopt(handle->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+            return -1;
+        }
+        handle->tx_frame_size = req.tp_frame_size;
+        handle->tx_frame_count = req.tp_frame_nr;
+        tx_size = (size_t)req.tp_block_size * req.tp_block_nr;
+    }
+
+    handle->ring_size = rx_size + tx_size;
+    handle->ring = mmap(NULL, handle->ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, handle->fd, 0);
+    if (handle->ring == MAP_FAILED) {
+        handle->ring = NULL;
+        return -1;
+    }
+    handle->rx_ring = rx_size ? handle->ring : NULL;
+    handle->tx_ring = tx_size ? handle->ring + rx_size : NULL;
+    return 0;
+}
+
+static int __packet_set_qdisc_bypass(void * handle, int enable) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    return setsockopt(dev_handle->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &enable, sizeof(enable));
+}
+
+// Frames are spread over every socket of the group, which has to be joined after bind()
+static int __packet_join_fanout(struct device_handle *handle, const hal_config_t *config) {
+    int mode;
+    switch (config->fanout_mode) {
+        case HAL_FANOUT_NONE:
+            return 0;
+        case HAL_FANOUT_HASH:
+            mode = PACKET_FANOUT_HASH;
+            break;
+        case HAL_FANOUT_CPU:
+            mode = PACKET_FANOUT_CPU;
+            break;
+        default:
+            return -1;
+    }
+    int arg = (config->fanout_group & 0xffff) | (mode << 16);
+    return setsockopt(handle->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg));
+}
+
+static void * __packet_create_device(const hal_config_t *config) {
+    const char *ifname = config->ifname;
+    struct device_handle *handle = malloc(sizeof(struct device_handle));
+    if (!handle) {
+       // close(handle->fd);
+        return NULL;
+    }
+    memset(handle, 0, sizeof(struct device_handle));
+    handle->base.ops = &hal_packet_ops;
+
+    struct ifreq ifr;
+    handle->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (handle->fd < 0) {
+        free(handle);
+        return NULL;
+    }
+    ifr.ifr_addr.sa_family = AF_PACKET;
+    snprintf(ifr.ifr_name, IFNAMSIZ, "%.*s", IFNAMSIZ-1, ifname);
+    ioctl(handle->fd, SIOCGIFHWADDR, &ifr);
+    memcpy(handle->mac, ifr.ifr_hwaddr.sa_data, 6);
+    ioctl(handle->fd, SIOCGIFADDR, &ifr);
+    memcpy(handle->ip, &((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr, 4);
+    ioctl(handle->fd, SIOCGIFINDEX, &ifr);
+    handle->index = ifr.ifr_ifindex;
+    snprintf(handle->name, HAL_IFACE_NAMELEN, "%s", ifname);
+    ioctl(handle->fd, SIOCGIFMTU, &ifr);
+    handle->mtu = ifr.ifr_mtu;
+
+    // The rings have to exist before bind() so no frame is queued outside of them
+    handle->rx_mode = config->rx_mode;
+    handle->tx_mode = config->tx_mode;
+    if ((handle->rx_mode == HAL_RX_MODE_RING || handle->tx_mode == HAL_TX_MODE_RING) &&
+        __packet_setup_rings(handle, config) < 0) {
+        close(handle->fd);
+        free(handle);
+        return NULL;
+    }
+    if (config->tx_qdisc_bypass) {
+        __packet_set_qdisc_bypass(handle, 1);
+    }
+    // Checksum and VLAN state of each frame as a control message, the ring
+    // carries it in the frame headers already. Best effort: without it
+    // frames just go up with no metadata.
+    if (handle->rx_mode != HAL_RX_MODE_RING) {
+        int one = 1;
+        setsockopt(handle->fd, SOL_PACKET, PACKET_AUXDATA, &one, sizeof(one));
+    }
+
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_ifindex = handle->index;
+    sll.sll_protocol = htons(ETH_P_ALL);
+
+    if (bind(handle->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0 || __packet_join_fanout(handle, config) < 0) {
+        if (handle->ring) munmap(handle->ring, handle->ring_size);
+        close(handle->fd);
+        free(handle);
+        return NULL;
+    }
+    return (void*)handle;
+}
+
+static void __packet_remove_device(void *handle) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    if (dev_handle->ring) {
+        munmap(dev_handle->ring, dev_handle->ring_size);
+    }
+    close(dev_handle->fd);
+    free(dev_handle);
+}
+
+static unsigned int __packet_send(void * handle, void * data, unsigned int length) {
+    return write(((struct device_handle *)handle)->fd, data, length);
+}
+
+static unsigned int __packet_receive(void * handle, void * buffer, unsigned int buffer_length) {
+    return read(((struct device_handle *)handle)->fd, buffer, buffer_length);
+}
+
+static unsigned int __packet_receive_batch(void * handle, hal_frame_t *frames, unsigned int count) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+
+    // One recvmmsg() for the whole batch, frames[i].length holds the buffer size on input
+    struct mmsghdr msgs[HAL_BATCH_MAX];
+    struct iovec iovs[HAL_BATCH_MAX];
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+    } controls[HAL_BATCH_MAX];
+    memset(msgs, 0, sizeof(struct mmsghdr) * count);
+    for (unsigned int i = 0; i < count; i++) {
+        iovs[i].iov_base = frames[i].data;
+        iovs[i].iov_len = frames[i].length;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = controls[i].buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof(controls[i].buf);
+    }
+    int received = recvmmsg(dev_handle->fd, msgs, count, MSG_DONTWAIT, NULL);
+    if (received <= 0) {
+        return 0;
+    }
+    for (int i = 0; i < received; i++) {
+        frames[i].length = msgs[i].msg_len;
+        frames[i].flags = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_AUXDATA &&
+                cmsg->cmsg_len >= CMSG_LEN(sizeof(struct tpacket_auxdata))) {
+                struct tpacket_auxdata aux;
+                memcpy(&aux, CMSG_DATA(cmsg), sizeof(aux));
+                __packet_frame_meta(&frames[i], aux.tp_status, aux.tp_vlan_tci, aux.tp_vlan_tpid);
+            }
+        }
+    }
+    return received;
+}
+
+static unsigned int __packet_send_batch(void * handle, hal_frame_t *frames, unsigned int count) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    struct mmsghdr msgs[HAL_BATCH_MAX];
+    struct iovec iovs[HAL_BATCH_MAX];
+    unsigned int sent = 0;
+    while (sent < count) {
+        unsigned int chunk = count - sent > HAL_BATCH_MAX ? HAL_BATCH_MAX : count - sent;
+        memset(msgs, 0, sizeof(struct mmsghdr) * chunk);
+        for (unsigned int i = 0; i < chunk; i++) {
+            iovs[i].iov_base = frames[sent + i].data;
+            iovs[i].iov_len = frames[sent + i].length;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        // sendmmsg() stops at the first failing frame, the caller accounts the rest
+        int result = sendmmsg(dev_handle->fd, msgs, chunk, 0);
+        if (result <= 0) {
+            break;
+        }
+        sent += result;
+        if ((unsigned int)result < chunk) {
+            break;
+        }
+    }
+    return sent;
+}
+
+static int __packet_wait(void * handle, int timeout_ms) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    struct pollfd pfd = { .fd = dev_handle->fd, .events = POLLIN | POLLERR, .revents = 0 };
+    return poll(&pfd, 1, timeout_ms);
+}
+
+static int __packet_get_fd(void * handle) {
+    return ((struct device_handle *)handle)->fd;
+}
+
+static unsigned int __packet_tx_inflight(void * handle) {
+    // Slots the last kick could not push out (device queue full)
+    return ((struct device_handle *)handle)->tx_pending;
+}
+
+static int __packet_set_busy_poll(void * handle, int usecs) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    return setsockopt(dev_handle->fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+}
+
+static unsigned int __packet_receive_zc(void * handle, hal_frame_t *frames, unsigned int max_frames) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    if (!dev_handle->rx_ring) {
+        return 0;
+    }
+
+    unsigned int count = 0;
+    while (count < max_frames) {
+        if (dev_handle->rx_block_left == 0) {
+            // Every block is consumed but not released yet, nothing more to hand out
+            if (dev_handle->rx_blocks_pending == dev_handle->rx_block_count) {
+                break;
+            }
+            struct tpacket_block_desc *block = __packet_rx_block(dev_handle, dev_handle->rx_block);
+            uint32_t status = __atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE);
+            if (!(status & TP_STATUS_USER)) {
+                break; // Kernel still owns it, see __packet_wait()
+            }
+            dev_handle->rx_block_left = block->hdr.bh1.num_pkts;
+            dev_handle->rx_frame = (struct tpacket3_hdr *)((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+            if (dev_handle->rx_block_left == 0) {
+                dev_handle->rx_block = (dev_handle->rx_block + 1) % dev_handle->rx_block_count;
+                dev_handle->rx_blocks_pending++;
+                continue;
+            }
+        }
+
+        struct tpacket3_hdr *hdr = dev_handle->rx_frame;
+        frames[count].data = (uint8_t *)hdr + hdr->tp_mac;
+        frames[count].length = hdr->tp_snaplen;
+        frames[count].timestamp = (uint64_t)hdr->tp_sec * 1000000000ULL + hdr->tp_nsec;
+        __packet_frame_meta(&frames[count], hdr->tp_status, hdr->hv1.tp_vlan_tci, hdr->hv1.tp_vlan_tpid);
+        count++;
+
+        if (--dev_handle->rx_block_left == 0) {
+            dev_handle->rx_block = (dev_handle->rx_block + 1) % dev_handle->rx_block_count;
+            dev_handle->rx_blocks_pending++;
+        } else {
+            dev_handle->rx_frame = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+        }
+    }
+    return count;
+}
+
+static void __packet_release_zc(void * handle) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    if (!dev_handle->rx_ring) {
+        return;
+    }
+    // Hand every fully consumed block back to the kernel, oldest first
+    unsigned int index = (dev_handle->rx_block + dev_handle->rx_block_count - dev_handle->rx_blocks_pending)
+                         % dev_handle->rx_block_count;
+    while (dev_handle->rx_blocks_pending > 0) {
+        struct tpacket_block_desc *block = __packet_rx_block(dev_handle, index);
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        index = (index + 1) % dev_handle->rx_block_count;
+        dev_handle->rx_blocks_pending--;
+    }
+}
+
+static int __packet_is_zero_copy(void * handle) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    return dev_handle->rx_ring != NULL;
+}
+
+static void * __packet_tx_acquire(void * handle, unsigned int *capacity) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    if (!dev_handle->tx_ring) {
+        return NULL;
+    }
+    // Slots are reused only once __packet_tx_kick() has reaped them
+    if (dev_handle->tx_pending == dev_handle->tx_frame_count) {
+        return NULL; // Ring full, the caller has to kick and retry
+    }
+    struct tpacket3_hdr *hdr = __packet_tx_slot(dev_handle, dev_handle->tx_head);
+    if (capacity) {
+        *capacity = dev_handle->tx_frame_size - __PACKET_TX_DATA_OFFSET;
+    }
+    return (uint8_t *)hdr + __PACKET_TX_DATA_OFFSET;
+}
+
+static void __packet_tx_commit(void * handle, unsigned int length) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    struct tpacket3_hdr *hdr = __packet_tx_slot(dev_handle, dev_handle->tx_head);
+    hdr->tp_len = length;
+    hdr->tp_snaplen = length;
+    hdr->tp_next_offset = 0;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    dev_handle->tx_head = (dev_handle->tx_head + 1) % dev_handle->tx_frame_count;
+    dev_handle->tx_pending++;
+}
+
+static int __packet_tx_kick(void * handle, unsigned int *failed) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    if (failed) {
+        *failed = 0;
+    }
+    if (!dev_handle->tx_ring) {
+        return -1;
+    }
+    if (dev_handle->tx_pending == 0) {
+        return 0;
+    }
+    // A single send() flushes every slot marked TP_STATUS_SEND_REQUEST. When the
+    // device queue is full (ENOBUFS, e.g. with qdisc bypass) the kernel leaves
+    // the remaining slots marked and resumes from them on the next kick.
+    if (send(dev_handle->fd, NULL, 0, 0) < 0 && errno != ENOBUFS && errno != EAGAIN) {
+        return -1;
+    }
+
+    // Reap completed slots, oldest first
+    int sent = 0;
+    unsigned int index = (dev_handle->tx_head + dev_handle->tx_frame_count - dev_handle->tx_pending)
+                         % dev_handle->tx_frame_count;
+    while (dev_handle->tx_pending > 0) {
+        struct tpacket3_hdr *hdr = __packet_tx_slot(dev_handle, index);
+        uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+        if (status == TP_STATUS_AVAILABLE) {
+            sent++;
+        } else if (status & TP_STATUS_WRONG_FORMAT) {
+            __atomic_store_n(&hdr->tp_status, TP_STATUS_AVAILABLE, __ATOMIC_RELEASE);
+            if (failed) {
+                (*failed)++;
+            }
+        } else {
+            break; // Still queued or in flight
+        }
+        index = (index + 1) % dev_handle->tx_frame_count;
+        dev_handle->tx_pending--;
+    }
+    return sent;
+}
+
+static int __packet_has_tx_ring(void * handle) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    return dev_handle->tx_ring != NULL;
+}
+
+static void __packet_get_mac_address(void * handle, unsigned char *mac) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    memcpy(mac, dev_handle->mac, 6);
+}
+
+static unsigned int __packet_get_mtu(void * handle) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    return dev_handle->mtu;
+}
+
+static int __packet_set_filter(void * handle, const hal_filter_insn_t *prog, unsigned int length) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    if (length == 0) {
+        int unused = 0;
+        if (setsockopt(dev_handle->fd, SOL_SOCKET, SO_DETACH_FILTER, &unused, sizeof(unused)) < 0 && errno != ENOENT) {
+            return -1;
+        }
+        return 0;
+    }
+    // hal_filter_insn_t mirrors struct sock_filter, the kernel takes it as is
+    struct sock_fprog fprog;
+    fprog.len = length;
+    fprog.filter = (struct sock_filter *)prog;
+    return setsockopt(dev_handle->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+}
+
+const hal_ops_t hal_packet_ops = {
+    .name = "packet",
+    .create_device = __packet_create_device,
+    .remove_device = __packet_remove_device,
+    .send = __packet_send,
+    .receive = __packet_receive,
+    .send_batch = __packet_send_batch,
+    .receive_batch = __packet_receive_batch,
+    .wait = __packet_wait,
+    .is_zero_copy = __packet_is_zero_copy,
+    .receive_zc = __packet_receive_zc,
+    .release_zc = __packet_release_zc,
+    .has_tx_ring = __packet_has_tx_ring,
+    .tx_acquire = __packet_tx_acquire,
+    .tx_commit = __packet_tx_commit,
+    .tx_kick = __packet_tx_kick,
+    .set_qdisc_bypass = __packet_set_qdisc_bypass,
+    .get_mac_address = __packet_get_mac_address,
+    .get_mtu = __packet_get_mtu,
+    .set_filter = __packet_set_filter,
+    .get_fd = __packet_get_fd,
+    .tx_inflight = __packet_tx_inflight,
+    .set_busy_poll = __packet_set_busy_poll
+};
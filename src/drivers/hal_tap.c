@@ -0,0 +1,212 @@
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "drivers/hal.h"
+
+// TAP backend. Frames are read from and written to /dev/net/tun, each one
+// preceded by a struct virtio_net_hdr (IFF_VNET_HDR). On TX the header asks
+// the kernel to finish partial checksums and to segment TCP super-frames, so
+// a large tcp_send() crosses into the kernel as a single write(). The kernel
+// stack sits on the other side of the interface, which makes tap0 a fully
+// local peer for tests.
+
+struct tap_handle {
+    hal_handle_t base;              // Must stay first, see hal.c
+    char name[HAL_IFACE_NAMELEN];
+    int fd;
+    unsigned char mac[6];
+    unsigned int mtu;
+};
+
+static void * __tap_create_device(const hal_config_t *config) {
+    if (config->fanout_mode != HAL_FANOUT_NONE) {
+        return NULL;    // Single queue only
+    }
+    struct tap_handle *handle = malloc(sizeof(struct tap_handle));
+    if (!handle) {
+        return NULL;
+    }
+    memset(handle, 0, sizeof(struct tap_handle));
+    handle->base.ops = &hal_tap_ops;
+
+    handle->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (handle->fd < 0) {
+        free(handle);
+        return NULL;
+    }
+
+    // Creates the interface or attaches to a persistent one of the same name
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+    snprintf(ifr.ifr_name, IFNAMSIZ, "%.*s", IFNAMSIZ-1, config->ifname);
+    int hdr_size = sizeof(struct virtio_net_hdr);
+    // Offloads we accept from the kernel: none, received frames arrive
+    // checksummed and already segmented
+    if (ioctl(handle->fd, TUNSETIFF, &ifr) < 0 ||
+        ioctl(handle->fd, TUNSETVNETHDRSZ, &hdr_size) < 0 ||
+        ioctl(handle->fd, TUNSETOFFLOAD, 0) < 0) {
+        close(handle->fd);
+        free(handle);
+        return NULL;
+    }
+    snprintf(handle->name, HAL_IFACE_NAMELEN, "%s", ifr.ifr_name);
+
+    // Bring the link up and read its MTU through a plain datagram socket
+    int ctl = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ctl >= 0) {
+        if (ioctl(ctl, SIOCGIFFLAGS, &ifr) == 0 && !(ifr.ifr_flags & IFF_UP)) {
+            ifr.ifr_flags |= IFF_UP;
+            ioctl(ctl, SIOCSIFFLAGS, &ifr);
+        }
+        if (ioctl(ctl, SIOCGIFMTU, &ifr) == 0) {
+            handle->mtu = ifr.ifr_mtu;
+        }
+        close(ctl);
+    }
+    if (handle->mtu == 0) {
+        handle->mtu = 1500;
+    }
+
+    // The interface MAC belongs to the kernel side, ours has to differ
+    unsigned int index = if_nametoindex(handle->name);
+    unsigned char mac[6] = {0x02, 0x00, 0x54, 0x41, (index >> 8) & 0xff, index & 0xff};
+    memcpy(handle->mac, mac, 6);
+    return (void *)handle;
+}
+
+static void __tap_remove_device(void *handle) {
+    struct tap_handle *tap = (struct tap_handle *)handle;
+    close(tap->fd);
+    free(tap);
+}
+
+static unsigned int __tap_write(struct tap_handle *tap, struct virtio_net_hdr *vnet, void *data, unsigned int length) {
+    struct iovec iov[2] = {
+        { .iov_base = vnet, .iov_len = sizeof(struct virtio_net_hdr) },
+        { .iov_base = data, .iov_len = length },
+    };
+    ssize_t written = writev(tap->fd, iov, 2);
+    if (written < (ssize_t)sizeof(struct virtio_net_hdr)) {
+        return 0;
+    }
+    return written - sizeof(struct virtio_net_hdr);
+}
+
+static unsigned int __tap_send(void *handle, void *data, unsigned int length) {
+    struct virtio_net_hdr vnet;
+    memset(&vnet, 0, sizeof(vnet));
+    return __tap_write((struct tap_handle *)handle, &vnet, data, length);
+}
+
+static unsigned int __tap_send_offload(void *handle, void *data, unsigned int length, const hal_offload_t *offload) {
+    struct virtio_net_hdr vnet;
+    memset(&vnet, 0, sizeof(vnet));
+    if (offload->flags & HAL_OFFLOAD_CSUM) {
+        vnet.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vnet.csum_start = offload->csum_start;
+        vnet.csum_offset = offload->csum_offset;
+    }
+    if (offload->flags & HAL_OFFLOAD_TSO4) {
+        vnet.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        vnet.gso_size = offload->gso_size;
+        vnet.hdr_len = offload->hdr_len;
+    }
+    return __tap_write((struct tap_handle *)handle, &vnet, data, length);
+}
+
+// flags, when not NULL, gets the HAL_FRAME_* bits of the virtio header
+static int __tap_read(struct tap_handle *tap, void *buffer, unsigned int buffer_length, unsigned int *flags) {
+    struct virtio_net_hdr vnet;
+    struct iovec iov[2] = {
+        { .iov_base = &vnet, .iov_len = sizeof(vnet) },
+        { .iov_base = buffer, .iov_len = buffer_length },
+    };
+    ssize_t received = readv(tap->fd, iov, 2);
+    if (received < (ssize_t)sizeof(vnet)) {
+        return -1;
+    }
+    if (flags) {
+        *flags = 0;
+        if (vnet.flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+            *flags |= HAL_FRAME_CSUM_VALID;
+        }
+        if (vnet.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+            *flags |= HAL_FRAME_CSUM_PARTIAL;
+        }
+    }
+    return received - sizeof(vnet);
+}
+
+static unsigned int __tap_receive(void *handle, void *buffer, unsigned int buffer_length) {
+    struct tap_handle *tap = (struct tap_handle *)handle;
+    int length;
+    while ((length = __tap_read(tap, buffer, buffer_length, NULL)) < 0 && errno == EAGAIN) {
+        struct pollfd pfd = { .fd = tap->fd, .events = POLLIN };
+        poll(&pfd, 1, -1);
+    }
+    return length < 0 ? 0 : length;
+}
+
+static unsigned int __tap_receive_batch(void *handle, hal_frame_t *frames, unsigned int count) {
+    // One readv() per frame, tun has no batched read
+    struct tap_handle *tap = (struct tap_handle *)handle;
+    unsigned int received = 0;
+    for (; received < count; received++) {
+        int length = __tap_read(tap, frames[received].data, frames[received].length, &frames[received].flags);
+        if (length < 0) {
+            break;
+        }
+        frames[received].length = length;
+    }
+    return received;
+}
+
+static int __tap_wait(void *handle, int timeout_ms) {
+    struct pollfd pfd = { .fd = ((struct tap_handle *)handle)->fd, .events = POLLIN };
+    return poll(&pfd, 1, timeout_ms);
+}
+
+static int __tap_get_fd(void *handle) {
+    return ((struct tap_handle *)handle)->fd;
+}
+
+static void __tap_get_mac_address(void *handle, unsigned char *mac) {
+    memcpy(mac, ((struct tap_handle *)handle)->mac, 6);
+}
+
+static unsigned int __tap_get_mtu(void *handle) {
+    return ((struct tap_handle *)handle)->mtu;
+}
+
+static unsigned int __tap_get_offloads(void *handle) {
+    (void)handle;
+    return HAL_OFFLOAD_CSUM | HAL_OFFLOAD_TSO4;
+}
+
+const hal_ops_t hal_tap_ops = {
+    .name = "tap",
+    .create_device = __tap_create_device,
+    .remove_device = __tap_remove_device,
+    .send = __tap_send,
+    .receive = __tap_receive,
+    .receive_batch = __tap_receive_batch,
+    .wait = __tap_wait,
+    .get_mac_address = __tap_get_mac_address,
+    .get_mtu = __tap_get_mtu,
+    .get_offloads = __tap_get_offloads,
+    .send_offload = __tap_send_offload,
+    .get_fd = __tap_get_fd
+};
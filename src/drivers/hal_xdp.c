@@ -0,0 +1,517 @@
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "drivers/hal.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+// Userspace view of one of the four AF_XDP rings
+struct xdp_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *desc;
+    uint32_t mask;
+    uint32_t size;
+    uint32_t cached_prod;           // Our producer index, published on submit
+    uint32_t cached_cons;           // Our consumer index, published on release
+    void *map;
+    size_t map_size;
+};
+
+// XSKMAP, program and link of one interface. Only one XDP program can be
+// attached per interface, so every queue opened on it shares this and only
+// puts its own socket in the map, at its queue_id.
+struct xdp_program {
+    int index;
+    unsigned int users;
+    unsigned int queue_count;       // Map entries: hardware queues [0, queue_count)
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    struct xdp_program *next;
+};
+
+static pthread_mutex_t __xdp_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xdp_program *__xdp_programs = NULL;
+
+struct xdp_handle {
+    hal_handle_t base;              // Must stay first, see hal.c
+    char name[HAL_IFACE_NAMELEN];
+    int fd;
+    int index;
+    unsigned int queue_id;
+    unsigned char mac[6];
+    unsigned int mtu;
+
+    // Kernel side: the interface's XSKMAP and XDP program, shared between queues
+    struct xdp_program *program;
+
+    // UMEM: frames [0, rx_frames) belong to the fill/RX rings, the rest to TX
+    uint8_t *umem;
+    size_t umem_size;
+    unsigned int frame_size;
+    unsigned int frame_count;
+    struct xdp_ring fill;
+    struct xdp_ring comp;
+    struct xdp_ring rx;
+    struct xdp_ring tx;
+
+    uint64_t *tx_free;              // Stack of free TX frame addresses
+    unsigned int tx_free_count;
+    unsigned int rx_taken;          // RX descriptors handed out, not yet released
+};
+
+static int __sys_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int __xdp_map_ring(struct xdp_handle *handle, struct xdp_ring *ring, const struct xdp_ring_offset *off,
+                          uint32_t size, size_t desc_size, off_t pgoff) {
+    ring->map_size = off->desc + size * desc_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, handle->fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return -1;
+    }
+    ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+    ring->flags = (uint32_t *)((uint8_t *)ring->map + off->flags);
+    ring->desc = (uint8_t *)ring->map + off->desc;
+    ring->size = size;
+    ring->mask = size - 1;
+    ring->cached_prod = *ring->producer;
+    ring->cached_cons = *ring->consumer;
+    return 0;
+}
+
+static void __xdp_unmap_ring(struct xdp_ring *ring) {
+    if (ring->map) {
+        munmap(ring->map, ring->map_size);
+        ring->map = NULL;
+    }
+}
+
+static int __xdp_setup_umem(struct xdp_handle *handle, uint32_t ring_size) {
+    handle->umem_size = (size_t)handle->frame_size * handle->frame_count;
+    handle->umem = mmap(NULL, handle->umem_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (handle->umem == MAP_FAILED) {
+        handle->umem = NULL;
+        return -1;
+    }
+
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t)(uintptr_t)handle->umem;
+    reg.len = handle->umem_size;
+    reg.chunk_size = handle->frame_size;
+    reg.headroom = 0;
+    if (setsockopt(handle->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(handle->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(handle->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(handle->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(handle->fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)) < 0) {
+        return -1;
+    }
+
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (getsockopt(handle->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+        return -1;
+    }
+    if (__xdp_map_ring(handle, &handle->fill, &off.fr, ring_size, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+        __xdp_map_ring(handle, &handle->comp, &off.cr, ring_size, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+        __xdp_map_ring(handle, &handle->rx, &off.rx, ring_size, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+        __xdp_map_ring(handle, &handle->tx, &off.tx, ring_size, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0) {
+        return -1;
+    }
+
+    // Post the RX half of the UMEM to the fill ring, keep the TX half on a free stack
+    unsigned int rx_frames = handle->frame_count / 2;
+    if (rx_frames > ring_size) {
+        rx_frames = ring_size;
+    }
+    uint64_t *fill = (uint64_t *)handle->fill.desc;
+    for (unsigned int i = 0; i < rx_frames; i++) {
+        fill[handle->fill.cached_prod++ & handle->fill.mask] = (uint64_t)i * handle->frame_size;
+    }
+    __atomic_store_n(handle->fill.producer, handle->fill.cached_prod, __ATOMIC_RELEASE);
+
+    handle->tx_free_count = 0;
+    handle->tx_free = malloc(sizeof(uint64_t) * (handle->frame_count - rx_frames));
+    if (!handle->tx_free) {
+        return -1;
+    }
+    for (unsigned int i = rx_frames; i < handle->frame_count; i++) {
+        handle->tx_free[handle->tx_free_count++] = (uint64_t)i * handle->frame_size;
+    }
+    return 0;
+}
+
+static void __xdp_program_free(struct xdp_program *program) {
+    // Closing the link detaches the program from the interface
+    if (program->link_fd >= 0) close(program->link_fd);
+    if (program->prog_fd >= 0) close(program->prog_fd);
+    if (program->map_fd >= 0) close(program->map_fd);
+    free(program);
+}
+
+static struct xdp_program * __xdp_program_create(int index, unsigned int queue_count) {
+    struct xdp_program *program = malloc(sizeof(struct xdp_program));
+    if (!program) {
+        return NULL;
+    }
+    memset(program, 0, sizeof(struct xdp_program));
+    program->index = index;
+    program->queue_count = queue_count;
+    program->map_fd = program->prog_fd = program->link_fd = -1;
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = queue_count;
+    program->map_fd = __sys_bpf(BPF_MAP_CREATE, &attr);
+    if (program->map_fd < 0) {
+        __xdp_program_free(program);
+        return NULL;
+    }
+
+    // return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+    struct bpf_insn prog[] = {
+        { .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1,
+          .off = 16 /* offsetof(struct xdp_md, rx_queue_index) */ },
+        { .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD,
+          .imm = program->map_fd },
+        { .code = 0 },
+        { .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+        { .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+        { .code = BPF_JMP | BPF_EXIT },
+    };
+    static const char license[] = "GPL";
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.license = (uint64_t)(uintptr_t)license;
+    program->prog_fd = __sys_bpf(BPF_PROG_LOAD, &attr);
+    if (program->prog_fd < 0) {
+        __xdp_program_free(program);
+        return NULL;
+    }
+
+    // Generic (SKB) mode works on any device, veth pairs included
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = program->prog_fd;
+    attr.link_create.target_ifindex = index;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+    program->link_fd = __sys_bpf(BPF_LINK_CREATE, &attr);
+    if (program->link_fd < 0) {
+        __xdp_program_free(program);
+        return NULL;
+    }
+    return program;
+}
+
+// Takes a reference on the interface's program, attaching it on first use
+static struct xdp_program * __xdp_program_get(int index, unsigned int queue_id, unsigned int queue_count) {
+    pthread_mutex_lock(&__xdp_lock);
+    struct xdp_program *program = __xdp_programs;
+    while (program && program->index != index) {
+        program = program->next;
+    }
+    if (!program) {
+        program = __xdp_program_create(index, queue_count > queue_id ? queue_count : queue_id + 1);
+        if (program) {
+            program->next = __xdp_programs;
+            __xdp_programs = program;
+        }
+    } else if (queue_id >= program->queue_count) {
+        program = NULL;     // The map was sized by the first opener
+    }
+    if (program) {
+        program->users++;
+    }
+    pthread_mutex_unlock(&__xdp_lock);
+    return program;
+}
+
+// Drops the reference; the last queue to close detaches the program
+static void __xdp_program_put(struct xdp_program *program) {
+    pthread_mutex_lock(&__xdp_lock);
+    if (--program->users == 0) {
+        struct xdp_program **prev = &__xdp_programs;
+        while (*prev != program) {
+            prev = &(*prev)->next;
+        }
+        *prev = program->next;
+        __xdp_program_free(program);
+    }
+    pthread_mutex_unlock(&__xdp_lock);
+}
+
+static int __xdp_attach_program(struct xdp_handle *handle, unsigned int queue_count) {
+    handle->program = __xdp_program_get(handle->index, handle->queue_id, queue_count);
+    if (!handle->program) {
+        return -1;
+    }
+
+    union bpf_attr attr;
+    uint32_t key = handle->queue_id;
+    uint32_t value = handle->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = handle->program->map_fd;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&value;
+    return __sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static void __xdp_remove_device(void *handle) {
+    struct xdp_handle *xdp = (struct xdp_handle *)handle;
+    if (!xdp) {
+        return;
+    }
+    if (xdp->program) {
+        // Stop redirecting our queue before the socket goes away
+        union bpf_attr attr;
+        uint32_t key = xdp->queue_id;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = xdp->program->map_fd;
+        attr.key = (uint64_t)(uintptr_t)&key;
+        __sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+        __xdp_program_put(xdp->program);
+    }
+    __xdp_unmap_ring(&xdp->fill);
+    __xdp_unmap_ring(&xdp->comp);
+    __xdp_unmap_ring(&xdp->rx);
+    __xdp_unmap_ring(&xdp->tx);
+    if (xdp->fd >= 0) close(xdp->fd);
+    if (xdp->umem) munmap(xdp->umem, xdp->umem_size);
+    free(xdp->tx_free);
+    free(xdp);
+}
+
+static void * __xdp_create_device(const hal_config_t *config) {
+    struct xdp_handle *handle = malloc(sizeof(struct xdp_handle));
+    if (!handle) {
+        return NULL;
+    }
+    memset(handle, 0, sizeof(struct xdp_handle));
+    handle->base.ops = &hal_xdp_ops;
+    handle->fd = -1;
+    snprintf(handle->name, HAL_IFACE_NAMELEN, "%s", config->ifname);
+    handle->queue_id = config->xdp_queue_id;
+    handle->frame_size = HAL_XDP_FRAME_SIZE;
+    handle->frame_count = config->xdp_frame_count ? config->xdp_frame_count : HAL_XDP_FRAME_COUNT;
+    uint32_t ring_size = config->xdp_ring_size ? config->xdp_ring_size : HAL_XDP_RING_SIZE;
+
+    // Interface details come from a plain datagram socket
+    struct ifreq ifr;
+    int ctl = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ctl < 0) {
+        free(handle);
+        return NULL;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, IFNAMSIZ, "%.*s", IFNAMSIZ-1, handle->name);
+    ioctl(ctl, SIOCGIFHWADDR, &ifr);
+    memcpy(handle->mac, ifr.ifr_hwaddr.sa_data, 6);
+    ioctl(ctl, SIOCGIFMTU, &ifr);
+    handle->mtu = ifr.ifr_mtu;
+    close(ctl);
+    handle->index = if_nametoindex(handle->name);
+
+    handle->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (handle->index == 0 || handle->fd < 0 || __xdp_setup_umem(handle, ring_size) < 0) {
+        __xdp_remove_device(handle);
+        return NULL;
+    }
+
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = handle->index;
+    sxdp.sxdp_queue_id = handle->queue_id;
+    sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+    if (bind(handle->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0 || __xdp_attach_program(handle, config->xdp_queue_count) < 0) {
+        __xdp_remove_device(handle);
+        return NULL;
+    }
+    return (void*)handle;
+}
+
+static unsigned int __xdp_receive_zc(void * handle, hal_frame_t *frames, unsigned int max_frames) {
+    struct xdp_handle *xdp = (struct xdp_handle *)handle;
+    uint32_t producer = __atomic_load_n(xdp->rx.producer, __ATOMIC_ACQUIRE);
+    uint32_t first = xdp->rx.cached_cons + xdp->rx_taken;
+    unsigned int available = producer - first;
+    unsigned int count = available < max_frames ? available : max_frames;
+
+    struct xdp_desc *desc = (struct xdp_desc *)xdp->rx.desc;
+    for (unsigned int i = 0; i < count; i++) {
+        struct xdp_desc *d = &desc[(first + i) & xdp->rx.mask];
+        frames[i].data = xdp->umem + d->addr;
+        frames[i].length = d->len;
+        frames[i].timestamp = 0;
+        frames[i].flags = 0;
+    }
+    xdp->rx_taken += count;
+    return count;
+}
+
+static void __xdp_release_zc(void * handle) {
+    struct xdp_handle *xdp = (struct xdp_handle *)handle;
+    if (xdp->rx_taken == 0) {
+        return;
+    }
+    // Recycle the frames straight into the fill ring, which is as large as the RX ring
+    struct xdp_desc *desc = (struct xdp_desc *)xdp->rx.desc;
+    uint64_t *fill = (uint64_t *)xdp->fill.desc;
+    for (unsigned int i = 0; i < xdp->rx_taken; i++) {
+        uint64_t addr = desc[(xdp->rx.cached_cons + i) & xdp->rx.mask].addr;
+        fill[xdp->fill.cached_prod++ & xdp->fill.mask] = addr - (addr % xdp->frame_size);
+    }
+    __atomic_store_n(xdp->fill.producer, xdp->fill.cached_prod, __ATOMIC_RELEASE);
+    xdp->rx.cached_cons += xdp->rx_taken;
+    __atomic_store_n(xdp->rx.consumer, xdp->rx.cached_cons, __ATOMIC_RELEASE);
+    xdp->rx_taken = 0;
+
+    if (__atomic_load_n(xdp->fill.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP) {
+        recvfrom(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+static unsigned int __xdp_reap_completions(struct xdp_handle *xdp) {
+    uint32_t producer = __atomic_load_n(xdp->comp.producer, __ATOMIC_ACQUIRE);
+    unsigned int count = producer - xdp->comp.cached_cons;
+    uint64_t *comp = (uint64_t *)xdp->comp.desc;
+    for (unsigned int i = 0; i < count; i++) {
+        xdp->tx_free[xdp->tx_free_count++] = comp[xdp->comp.cached_cons++ & xdp->comp.mask];
+    }
+    __atomic_store_n(xdp->comp.consumer, xdp->comp.cached_cons, __ATOMIC_RELEASE);
+    return count;
+}
+
+static void * __xdp_tx_acquire(void * handle, unsigned int *capacity) {
+    struct xdp_handle *xdp = (struct xdp_handle *)handle;
+    if (xdp->tx_free_count == 0) {
+        __xdp_reap_completions(xdp);
+    }
+    uint32_t consumer = __atomic_load_n(xdp->tx.consumer, __ATOMIC_ACQUIRE);
+    if (xdp->tx_free_count == 0 || xdp->tx.cached_prod - consumer >= xdp->tx.size) {
+        return NULL; // The caller has to kick and retry
+    }
+    if (capacity) {
+        *capacity = xdp->frame_size;
+    }
+    return xdp->umem + xdp->tx_free[xdp->tx_free_count - 1];
+}
+
+static void __xdp_tx_commit(void * handle, unsigned int length) {
+    struct xdp_handle *xdp = (struct xdp_handle *)handle;
+    struct xdp_desc *desc = (struct xdp_desc *)xdp->tx.desc;
+    struct xdp_desc *d = &desc[xdp->tx.cached_prod++ & xdp->tx.mask];
+    d->addr = xdp->tx_free[--xdp->tx_free_count];
+    d->len = length;
+    d->options = 0;
+}
+
+static int __xdp_tx_kick(void * handle, unsigned int *failed) {
+    struct xdp_handle *xdp = (struct xdp_handle *)handle;
+    if (failed) {
+        *failed = 0;
+    }
+    if (*xdp->tx.producer != xdp->tx.cached_prod) {
+        __atomic_store_n(xdp->tx.producer, xdp->tx.cached_prod, __ATOMIC_RELEASE);
+        // Copy mode always needs the syscall to push the descriptors out
+        if (sendto(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+            errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN) {
+            return -1;
+        }
+    }
+    return __xdp_reap_completions(xdp);
+}
+
+static int __xdp_wait(void * handle, int timeout_ms) {
+    struct xdp_handle *xdp = (struct xdp_handle *)handle;
+    struct pollfd pfd = { .fd = xdp->fd, .events = POLLIN, .revents = 0 };
+    return poll(&pfd, 1, timeout_ms);
+}
+
+static int __xdp_get_fd(void * handle) {
+    return ((struct xdp_handle *)handle)->fd;
+}
+
+static unsigned int __xdp_tx_inflight(void * handle) {
+    // Every committed descriptor comes back exactly once through the completion ring
+    struct xdp_handle *xdp = (struct xdp_handle *)handle;
+    return xdp->tx.cached_prod - xdp->comp.cached_cons;
+}
+
+static int __xdp_set_busy_poll(void * handle, int usecs) {
+    struct xdp_handle *xdp = (struct xdp_handle *)handle;
+    return setsockopt(xdp->fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+}
+
+static void __xdp_get_mac_address(void * handle, unsigned char *mac) {
+    struct xdp_handle *xdp = (struct xdp_handle *)handle;
+    if (xdp && mac) {
+        memcpy(mac, xdp->mac, 6);
+    }
+}
+
+static unsigned int __xdp_get_mtu(void * handle) {
+    struct xdp_handle *xdp = (struct xdp_handle *)handle;
+    return xdp ? xdp->mtu : 0;
+}
+
+static int __xdp_is_zero_copy(void * handle) {
+    (void)handle;
+    return 1;
+}
+
+static int __xdp_has_tx_ring(void * handle) {
+    (void)handle;
+    return 1;
+}
+
+const hal_ops_t hal_xdp_ops = {
+    .name = "xdp",
+    .create_device = __xdp_create_device,
+    .remove_device = __xdp_remove_device,
+    .wait = __xdp_wait,
+    .is_zero_copy = __xdp_is_zero_copy,
+    .receive_zc = __xdp_receive_zc,
+    .release_zc = __xdp_release_zc,
+    .has_tx_ring = __xdp_has_tx_ring,
+    .tx_acquire = __xdp_tx_acquire,
+    .tx_commit = __xdp_tx_commit,
+    .tx_kick = __xdp_tx_kick,
+    .get_mac_address = __xdp_get_mac_address,
+    .get_mtu = __xdp_get_mtu,
+    .get_fd = __xdp_get_fd,
+    .tx_inflight = __xdp_tx_inflight,
+    .set_busy_poll = __xdp_set_busy_poll
+};
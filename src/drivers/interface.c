@@ -1,8 +1,14 @@
+#define _GNU_SOURCE
 
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 
 #include "drivers/interface.h"
 #include "drivers/hal.h"
@@ -25,131 +31,879 @@ typedef enum {
 #define __SET_RX_CB(flags)      ((flags) |= __RX_CB_FLAG)
 #define __SET_ERROR_CB(flags)   ((flags) |= __ERROR_CB_FLAG)
 
-status_t __nic_add_callback(nic_callback_t **callback_list, nic_event_callback_t callback) {
-    nic_callback_t *new_callback = (nic_callback_t *)malloc(sizeof(nic_callback_t));
-    if (!new_callback) {
-        return STATUS_ERROR;
+//Callback lists are read-copy-update: the NIC threads walk the current
+//snapshot with no lock, writers publish a modified copy and retire the old
+//one. Every NIC thread reports a quiescent state (no snapshot held) at the top
+//of each loop iteration by storing the current epoch, and stores 0 while it
+//sleeps. A snapshot retired at epoch E is freed once no awake thread reports
+//less than E. Writers never wait, so a callback may (un)register callbacks.
+static void __nic_rcu_quiescent(nic_queue_t *queue) {
+    uint64_t epoch = __atomic_load_n(&queue->device->rcu_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&queue->rcu_epoch, epoch, __ATOMIC_SEQ_CST);
+}
+
+static void __nic_rcu_offline(nic_queue_t *queue) {
+    __atomic_store_n(&queue->rcu_epoch, 0, __ATOMIC_RELEASE);
+}
+
+static uint64_t __nic_rcu_oldest(nic_device_t *device) {
+    uint64_t oldest = UINT64_MAX;
+    for (unsigned int i = 0; i <= device->queue_count; i++) {
+        nic_queue_t *queue = i < device->queue_count ? &device->queues[i] : &device->tx_queue;
+        uint64_t epoch = __atomic_load_n(&queue->rcu_epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
+
+//Called with callback_lock held, or once the threads are gone (oldest = UINT64_MAX)
+static void __nic_rcu_reclaim(nic_device_t *device, uint64_t oldest) {
+    nic_callback_set_t **prev = &device->retired_callbacks;
+    while (*prev) {
+        nic_callback_set_t *set = *prev;
+        if (set->retire_epoch <= oldest) {
+            *prev = set->retired_next;
+            free(set);
+        } else {
+            prev = &set->retired_next;
+        }
+    }
+}
+
+static status_t __nic_update_callbacks(nic_device_t *device, nic_callback_set_t **list, nic_event_callback_t callback, int add) {
+    pthread_mutex_lock(&device->callback_lock);
+    nic_callback_set_t *old = *list;
+    unsigned int count = old ? old->count : 0;
+    unsigned int found = count;
+    for (unsigned int i = 0; i < count; i++) {
+        if (old->callbacks[i] == callback) {
+            found = i;
+            break;
+        }
+    }
+    if (!add && found == count) {
+        pthread_mutex_unlock(&device->callback_lock);
+        return STATUS_NOT_SUPPORTED; // Callback not found
+    }
+
+    unsigned int new_count = add ? count + 1 : count - 1;
+    nic_callback_set_t *set = NULL;
+    if (new_count > 0) {
+        set = (nic_callback_set_t *)malloc(sizeof(nic_callback_set_t) + new_count * sizeof(nic_event_callback_t));
+        if (!set) {
+            pthread_mutex_unlock(&device->callback_lock);
+            return STATUS_ERROR;
+        }
+        set->retired_next = NULL;
+        set->retire_epoch = 0;
+        set->count = 0;
+        for (unsigned int i = 0; i < count; i++) {
+            if (add || i != found) {
+                set->callbacks[set->count++] = old->callbacks[i];
+            }
+        }
+        if (add) {
+            set->callbacks[set->count++] = callback;
+        }
+    }
+    __atomic_store_n(list, set, __ATOMIC_SEQ_CST);
+    if (old) {
+        //Threads that report this epoch or a later one loaded the new snapshot
+        old->retire_epoch = __atomic_add_fetch(&device->rcu_epoch, 1, __ATOMIC_SEQ_CST);
+        old->retired_next = device->retired_callbacks;
+        device->retired_callbacks = old;
     }
-    new_callback->callback = callback;
-    new_callback->next = *callback_list;
-    *callback_list = new_callback;
+    __nic_rcu_reclaim(device, __nic_rcu_oldest(device));
+    pthread_mutex_unlock(&device->callback_lock);
     return STATUS_OK;
 }
 
-status_t __nic_remove_callback(nic_callback_t **callback_list, nic_event_callback_t callback) {
-    nic_callback_t *current = *callback_list;
-    nic_callback_t *previous = NULL;
-    while (current) {
-        if (current->callback == callback) {
-            if (previous) {
-                previous->next = current->next;
-            } else {
-                *callback_list = current->next;
+static void __nic_free_callbacks(nic_callback_set_t **list) {
+    free(*list);
+    *list = NULL;
+}
+
+//Statistics shards have a single writer, which bumps its counters with
+//relaxed stores: no locked instruction per frame, and readers summing the
+//shards never see a torn value
+#define __NIC_STAT_ADD(counter, n)  __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+
+static __thread int __nic_stats_shard = -1;
+static unsigned int __nic_stats_next_shard = 0;
+
+//Drops seen by sending threads, any number of them: spread over the shards
+static void __nic_count_drop(nic_device_t *device, unsigned int reason) {
+    if (__nic_stats_shard < 0) {
+        __nic_stats_shard = __atomic_fetch_add(&__nic_stats_next_shard, 1, __ATOMIC_RELAXED) % NIC_STATS_SHARDS;
+    }
+    __atomic_fetch_add(&device->stats_shards[__nic_stats_shard].drops[reason], 1, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int __nic_size_bucket(unsigned int length) {
+    if (length < 64) {
+        return 0;
+    }
+    if (length > 1518) {
+        return NIC_STATS_SIZE_BUCKETS - 1;
+    }
+    //64 -> 1, 65-127 -> 2, ... 1024-1518 -> 6
+    return length == 64 ? 1 : 32 - __builtin_clz(length - 1) - 5;
+}
+
+static inline void __nic_count_rx(nic_stats_t *stats, const hal_frame_t *frame) {
+    const unsigned char *data = (const unsigned char *)frame->data;
+    __NIC_STAT_ADD(stats->rx_bytes, frame->length);
+    __NIC_STAT_ADD(stats->rx_size_hist[__nic_size_bucket(frame->length)], 1);
+    if (frame->length < 14) {
+        return;
+    }
+    unsigned int type_class;
+    switch ((data[12] << 8) | data[13]) {
+        case 0x0800:
+            type_class = NIC_STATS_ETH_IPV4;
+            if (frame->length >= 34) {
+                __NIC_STAT_ADD(stats->rx_ip_protocol[data[23]], 1);
             }
-            free(current);
-            return STATUS_OK;
+            break;
+        case 0x0806: type_class = NIC_STATS_ETH_ARP; break;
+        case 0x86DD: type_class = NIC_STATS_ETH_IPV6; break;
+        case 0x8100:
+        case 0x88A8: type_class = NIC_STATS_ETH_VLAN; break;
+        default: type_class = NIC_STATS_ETH_OTHER; break;
+    }
+    __NIC_STAT_ADD(stats->rx_ethertype[type_class], 1);
+}
+
+static inline void __nic_count_tx(nic_stats_t *stats, unsigned int length) {
+    __NIC_STAT_ADD(stats->tx_bytes, length);
+    __NIC_STAT_ADD(stats->tx_size_hist[__nic_size_bucket(length)], 1);
+}
+
+//nic_stats_t is nothing but unsigned long counters: add a shard field by field
+static void __nic_stats_add(nic_stats_t *total, const nic_stats_t *shard) {
+    unsigned long *dst = (unsigned long *)total;
+    const unsigned long *src = (const unsigned long *)shard;
+    for (size_t i = 0; i < sizeof(nic_stats_t) / sizeof(unsigned long); i++) {
+        dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+static void __nic_stats_totals(nic_stats_t *stats) {
+    stats->rx_dropped = stats->drops[NIC_DROP_RX_FIFO_FULL] + stats->drops[NIC_DROP_RX_NO_MBUF] +
+                        stats->drops[NIC_DROP_RX_TRUNCATED];
+    stats->tx_dropped = stats->drops[NIC_DROP_TX_RING_FULL] + stats->drops[NIC_DROP_TX_NO_MBUF] +
+                        stats->drops[NIC_DROP_TX_INVALID];
+}
+
+static void __nic_fire_error_callbacks(nic_device_t *device) {
+    nic_callback_set_t *set = __atomic_load_n(&device->error_callbacks, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; set && i < set->count; i++) {
+        set->callbacks[i](NULL, 0);
+    }
+}
+
+//The copy keeps the frame's metadata for nic_receive_batch()
+static nic_mbuf_t * __nic_rx_copy(nic_queue_t *queue, const hal_frame_t *frame) {
+    nic_device_t *device = queue->device;
+    nic_mbuf_t *mbuf = nic_mbuf_alloc(device->pool, frame->length);
+    if (!mbuf) {
+        __NIC_STAT_ADD(queue->stats.drops[NIC_DROP_RX_NO_MBUF], 1);
+        __nic_fire_error_callbacks(device);
+        return NULL;
+    }
+    memcpy(nic_mbuf_data(mbuf), frame->data, frame->length);
+    mbuf->timestamp = frame->timestamp;
+    mbuf->flags = frame->flags;
+    mbuf->vlan_tci = frame->vlan_tci;
+    mbuf->vlan_tpid = frame->vlan_tpid;
+    return mbuf;
+}
+
+//Append a burst of copies to the RX FIFO, one lock for all of them. When
+//it is full either the new frame or the oldest one is dropped.
+static void __nic_rx_enqueue(nic_queue_t *queue, nic_mbuf_t **mbufs, unsigned int count) {
+    nic_device_t *device = queue->device;
+    if (count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&device->rx_lock);
+    for (unsigned int i = 0; i < count; i++) {
+        if (device->rx_count == device->rx_ring_size) {
+            __NIC_STAT_ADD(queue->stats.drops[NIC_DROP_RX_FIFO_FULL], 1);
+            if (device->rx_drop_policy != NIC_RX_DROP_HEAD) {
+                nic_mbuf_free(mbufs[i]);
+                continue;
+            }
+            nic_mbuf_free(device->rx_ring[device->rx_head]);
+            device->rx_head = (device->rx_head + 1) % device->rx_ring_size;
+            device->rx_count--;
         }
-        previous = current;
-        current = current->next;
+        device->rx_ring[(device->rx_head + device->rx_count) % device->rx_ring_size] = mbufs[i];
+        device->rx_count++;
     }
-    return STATUS_NOT_SUPPORTED; // Callback not found
+    if (device->rx_waiters) {
+        pthread_cond_broadcast(&device->rx_cond);
+    }
+    pthread_mutex_unlock(&device->rx_lock);
 }
 
-void __nic_thread(void * args) {
-    nic_device_t *device = (nic_device_t *)args;
-    //Main NIC processing loop
-    //1) update the rx buffer reading from hardware and update stats
-    //2) send everything in the tx buffer to hardware and update stats
-    //3) trigger callbacks as needed
-    unsigned char working_buffer[device->mtu+NIC_EXTRA_SIZE];
-    unsigned int received_length = 0;
-    flags_t internal_flags = __TX_FLAGS_NONE;
-    while (device->is_up) {
-        __CLEAR_ALL_FLAGS(internal_flags);
-        //Step 1: Receive packets from hardware into working buffer
-        received_length = hal_receive(device->hw_handle, working_buffer, device->mtu+NIC_EXTRA_SIZE);
-        if (received_length > 0) {
-            //Update rx statistics
-            device->stats.rx_packets++;
-            //Copy received data into rx buffer
-            nic_buffer_t *new_rx_buffer = (nic_buffer_t *)malloc(sizeof(nic_buffer_t));
-            if (new_rx_buffer) {
-                new_rx_buffer->data = malloc(received_length);
-                if (new_rx_buffer->data) {
-                    memcpy(new_rx_buffer->data, working_buffer, received_length);
-                    new_rx_buffer->length = received_length;
-                    new_rx_buffer->next = device->rx_buffer;
-                    device->rx_buffer = new_rx_buffer;
-                    __SET_RX_CB(internal_flags);
-                } else {
-                    free(new_rx_buffer);
-                    device->stats.rx_errors++;
-                    __SET_ERROR_CB(internal_flags);
-                    nic_callback_t *error_cb = device->error_callbacks;
-                    while (error_cb) {
-                        if (error_cb->callback) error_cb->callback(NULL, 0);
-                        error_cb = error_cb->next;
-                    }
+static uint64_t __nic_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline nic_ethertype_handler_t __nic_ethertype_handler(nic_device_t *device, const void *frame, unsigned int length) {
+    if (length < 14) {
+        return NULL;
+    }
+    const unsigned char *type = (const unsigned char *)frame + 12;
+    nic_ethertype_handler_t *page = __atomic_load_n(&device->ethertypes[type[0]], __ATOMIC_ACQUIRE);
+    return page ? __atomic_load_n(&page[type[1]], __ATOMIC_ACQUIRE) : NULL;
+}
+
+//Hand a burst up: once to each burst callback, then frame by frame to the
+//per-frame callbacks. Frames nobody consumes are kept for nic_receive_packet().
+static void __nic_deliver_burst(nic_queue_t *queue, hal_frame_t *frames, unsigned int count) {
+    nic_device_t *device = queue->device;
+    if (count == 0) {
+        return;
+    }
+    __NIC_STAT_ADD(queue->stats.rx_packets, count);
+    for (unsigned int i = 0; i < count; i++) {
+        __nic_count_rx(&queue->stats, &frames[i]);
+    }
+    //One snapshot of each list for the whole burst
+    nic_callback_set_t *burst_cbs = __atomic_load_n(&device->rx_burst_callbacks, __ATOMIC_ACQUIRE);
+    nic_callback_set_t *rx_cbs = __atomic_load_n(&device->rx_callbacks, __ATOMIC_ACQUIRE);
+    if (burst_cbs) {
+        //Backends without a kernel timestamp get one read of the clock per burst
+        uint64_t now = 0;
+        for (unsigned int i = 0; i < count; i++) {
+            if (frames[i].timestamp == 0) {
+                if (now == 0) {
+                    now = __nic_now_ns();
                 }
+                frames[i].timestamp = now;
             }
         }
-        //Step 2: Send packets from tx buffer to hardware
-        nic_buffer_t *tx_buf = device->tx_buffer;
-        while (tx_buf) {
-            unsigned int sent_length = hal_send(device->hw_handle, tx_buf->data, tx_buf->length);
-            if (sent_length == tx_buf->length) {
-                device->stats.tx_packets++;
-                __SET_TX_CB(internal_flags);
+        for (unsigned int i = 0; i < burst_cbs->count; i++) {
+            ((nic_burst_callback_t)burst_cbs->callbacks[i])(frames, count);
+        }
+    }
+    nic_mbuf_t *copies[NIC_RX_BURST];
+    unsigned int copied = 0;
+    uint64_t now = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        //A registered protocol takes the frame, one table lookup whatever the type
+        nic_ethertype_handler_t handler = __nic_ethertype_handler(device, frames[i].data, frames[i].length);
+        if (handler) {
+            handler(device, &frames[i]);
+        } else if (rx_cbs) {
+            for (unsigned int j = 0; j < rx_cbs->count; j++) {
+                rx_cbs->callbacks[j](frames[i].data, frames[i].length);
+            }
+        } else if (!burst_cbs) {
+            //Nobody consumes frames as they arrive, keep a copy for nic_receive_packet(),
+            //stamped like the burst callbacks would see it
+            if (frames[i].timestamp == 0) {
+                if (now == 0) {
+                    now = __nic_now_ns();
+                }
+                frames[i].timestamp = now;
+            }
+            nic_mbuf_t *copy = __nic_rx_copy(queue, &frames[i]);
+            if (copy) {
+                copies[copied++] = copy;
+            }
+        }
+    }
+    __nic_rx_enqueue(queue, copies, copied);
+}
+
+static unsigned int __nic_receive_zc(nic_queue_t *queue, hal_frame_t *frames) {
+    //Callbacks see the frames in place in the ring, which is released
+    //block-wise once the whole burst has been handed up
+    unsigned int count = hal_receive_zc(queue->hw_handle, frames, NIC_RX_BURST);
+    __nic_deliver_burst(queue, frames, count);
+    hal_release_zc(queue->hw_handle);
+    return count;
+}
+
+static unsigned int __nic_receive_batch(nic_queue_t *queue, hal_frame_t *frames, unsigned char *storage, unsigned int frame_size) {
+    for (unsigned int i = 0; i < NIC_RX_BURST; i++) {
+        frames[i].data = storage + (size_t)i * frame_size;
+        frames[i].length = frame_size;
+        frames[i].timestamp = 0;
+        frames[i].flags = 0;
+    }
+    unsigned int count = hal_receive_batch(queue->hw_handle, frames, NIC_RX_BURST);
+    __nic_deliver_burst(queue, frames, count);
+    return count;
+}
+
+static void __nic_free_tx(nic_buffer_t *bufs, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        nic_mbuf_free(bufs[i].mbuf);
+    }
+}
+
+//Take a burst off the TX ring and give its slots back to the limit
+static unsigned int __nic_tx_dequeue(nic_device_t *device, nic_buffer_t *tx_bufs) {
+    unsigned int count = nic_ring_dequeue_burst(device->tx_ring, tx_bufs, NIC_TX_BURST);
+    if (count) {
+        __atomic_fetch_sub(&device->tx_queued, count, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+static void __nic_kick_ring(nic_queue_t *queue, flags_t *flags) {
+    nic_device_t *device = queue->device;
+    unsigned int failed = 0;
+    int sent = hal_tx_kick(queue->hw_handle, &failed);
+    if (sent < 0) {
+        __NIC_STAT_ADD(queue->stats.tx_errors, 1);
+        __SET_ERROR_CB(*flags);
+        __nic_fire_error_callbacks(device);
+        return;
+    }
+    __NIC_STAT_ADD(queue->stats.tx_packets, sent);
+    __NIC_STAT_ADD(queue->stats.tx_errors, failed);
+    if (failed) {
+        __SET_ERROR_CB(*flags);
+        __nic_fire_error_callbacks(device);
+    }
+    if (sent > 0) {
+        __SET_TX_CB(*flags);
+    }
+}
+
+static unsigned int __nic_transmit_ring(nic_queue_t *queue, nic_buffer_t *tx_bufs, flags_t *flags) {
+    nic_device_t *device = queue->device;
+    unsigned int count = __nic_tx_dequeue(device, tx_bufs);
+    for (unsigned int i = 0; i < count; i++) {
+        nic_buffer_t *tx_buf = &tx_bufs[i];
+        if (tx_buf->offload.flags) {
+            //A ring slot carries no offload metadata: flush the slots filled so
+            //far to keep the order, then hand the frame to the backend with it
+            __nic_kick_ring(queue, flags);
+            unsigned int length = tx_buf->mbuf->length;
+            if (hal_send_offload(queue->hw_handle, nic_mbuf_data(tx_buf->mbuf), length, &tx_buf->offload) == length) {
+                __nic_count_tx(&queue->stats, length);
+                __NIC_STAT_ADD(queue->stats.tx_packets, 1);
+                __SET_TX_CB(*flags);
             } else {
-                device->stats.tx_errors++;
-                __SET_ERROR_CB(internal_flags);
-                nic_callback_t *error_cb = device->error_callbacks;
-                while (error_cb) {
-                    if (error_cb->callback) error_cb->callback(NULL, 0);
-                    error_cb = error_cb->next;
+                __NIC_STAT_ADD(queue->stats.tx_errors, 1);
+                __SET_ERROR_CB(*flags);
+                __nic_fire_error_callbacks(device);
+            }
+            continue;
+        }
+        unsigned int capacity = 0;
+        void *slot = hal_tx_acquire(queue->hw_handle, &capacity);
+        if (!slot) {
+            //Ring full: flush what we have so the kernel frees slots
+            __nic_kick_ring(queue, flags);
+            slot = hal_tx_acquire(queue->hw_handle, &capacity);
+        }
+        if (slot && tx_buf->mbuf->length <= capacity) {
+            memcpy(slot, nic_mbuf_data(tx_buf->mbuf), tx_buf->mbuf->length);
+            hal_tx_commit(queue->hw_handle, tx_buf->mbuf->length);
+            __nic_count_tx(&queue->stats, tx_buf->mbuf->length);
+        } else {
+            __NIC_STAT_ADD(queue->stats.tx_errors, 1);
+            __SET_ERROR_CB(*flags);
+            __nic_fire_error_callbacks(device);
+        }
+    }
+    __nic_free_tx(tx_bufs, count);
+    //One kick for the whole batch, also retries slots left over by a full device queue
+    __nic_kick_ring(queue, flags);
+    return count;
+}
+
+//Send a batch and count bytes for the frames the backend took, which are the
+//first ones: the rest are counted as errors by the caller
+static unsigned int __nic_send_batch(nic_queue_t *queue, hal_frame_t *frames, unsigned int count) {
+    unsigned int sent = hal_send_batch(queue->hw_handle, frames, count);
+    for (unsigned int i = 0; i < sent; i++) {
+        __nic_count_tx(&queue->stats, frames[i].length);
+    }
+    return sent;
+}
+
+static unsigned int __nic_transmit_batch(nic_queue_t *queue, nic_buffer_t *tx_bufs, hal_frame_t *frames, flags_t *flags) {
+    nic_device_t *device = queue->device;
+    unsigned int count = __nic_tx_dequeue(device, tx_bufs);
+    if (count == 0) {
+        return 0;
+    }
+    unsigned int sent = 0;
+    unsigned int batched = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        nic_buffer_t *tx_buf = &tx_bufs[i];
+        if (tx_buf->offload.flags) {
+            //Offloaded frames carry their own metadata and go out one by one,
+            //after whatever was batched before them to keep the order
+            if (batched) {
+                sent += __nic_send_batch(queue, frames, batched);
+                batched = 0;
+            }
+            unsigned int length = tx_buf->mbuf->length;
+            if (hal_send_offload(queue->hw_handle, nic_mbuf_data(tx_buf->mbuf), length, &tx_buf->offload) == length) {
+                __nic_count_tx(&queue->stats, length);
+                sent++;
+            }
+            continue;
+        }
+        frames[batched].data = nic_mbuf_data(tx_buf->mbuf);
+        frames[batched].length = tx_buf->mbuf->length;
+        batched++;
+    }
+    if (batched) {
+        sent += __nic_send_batch(queue, frames, batched);
+    }
+    __NIC_STAT_ADD(queue->stats.tx_packets, sent);
+    if (sent > 0) {
+        __SET_TX_CB(*flags);
+    }
+    if (sent < count) {
+        __NIC_STAT_ADD(queue->stats.tx_errors, count - sent);
+        __SET_ERROR_CB(*flags);
+        __nic_fire_error_callbacks(device);
+    }
+    __nic_free_tx(tx_bufs, count);
+    return count;
+}
+
+//Ring the queue's doorbell, only needed when its worker sleeps in epoll
+static void __nic_wake_queue(nic_queue_t *queue) {
+    if (__atomic_load_n(&queue->sleeping, __ATOMIC_SEQ_CST) && queue->wake_fd >= 0) {
+        uint64_t one = 1;
+        if (write(queue->wake_fd, &one, sizeof(one)) < 0) {
+            //Counter saturated, the worker is woken anyway
+        }
+    }
+}
+
+static uint64_t __nic_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+//Block until the hardware or the doorbell has something for this queue
+static void __nic_sleep(nic_queue_t *queue) {
+    nic_device_t *device = queue->device;
+    if (queue->epoll_fd < 0) {
+        hal_wait(queue->hw_handle, HAL_POLL_TIMEOUT_MS);
+        return;
+    }
+    __atomic_store_n(&queue->sleeping, 1, __ATOMIC_SEQ_CST);
+    int ready = hal_prepare_wait(queue->hw_handle);
+    if (!ready && device->is_up) {
+        struct epoll_event events[2];
+        int count = epoll_wait(queue->epoll_fd, events, 2, NIC_IDLE_TIMEOUT_MS);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.fd == queue->wake_fd) {
+                uint64_t value;
+                if (read(queue->wake_fd, &value, sizeof(value)) < 0) {
+                    //Already drained
                 }
             }
-            nic_buffer_t *temp = tx_buf;
-            tx_buf = tx_buf->next;
-            free(temp->data);
-            free(temp);
         }
-        device->tx_buffer = NULL;
-        //Step 3: Trigger callbacks based on internal flags
-        if (__GET_RX_CB(internal_flags)) {
-            nic_callback_t *cb = device->rx_callbacks;
-            while (cb) {
-                if (cb->callback) cb->callback(working_buffer, received_length);
-                cb = cb->next;
+    }
+    hal_finish_wait(queue->hw_handle);
+    __atomic_store_n(&queue->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+//Check and store TX queue limits, zero fields take the defaults
+static status_t __nic_set_tx_limits(nic_device_t *device, const nic_tx_limits_t *limits) {
+    unsigned int capacity = device->tx_ring->size;
+    unsigned int limit = limits->limit ? limits->limit : capacity;
+    unsigned int high = limits->high_watermark ? limits->high_watermark : limit - limit / 4;
+    unsigned int low = limits->low_watermark ? limits->low_watermark : limit / 4;
+    if (limit > capacity || high > limit || low >= high) {
+        return STATUS_INVALID_PARAM;
+    }
+    __atomic_store_n(&device->tx_limits.limit, limit, __ATOMIC_RELAXED);
+    __atomic_store_n(&device->tx_limits.high_watermark, high, __ATOMIC_RELAXED);
+    __atomic_store_n(&device->tx_limits.low_watermark, low, __ATOMIC_RELAXED);
+    return STATUS_OK;
+}
+
+//Tell producers to pause when the TX queue reaches the high watermark and to
+//resume once it is down to the low one. Sampled before each burst is taken,
+//when the queue is at its deepest since the previous one.
+static void __nic_tx_watermarks(nic_queue_t *queue) {
+    nic_device_t *device = queue->device;
+    unsigned int queued = nic_ring_count(device->tx_ring);
+    int congested;
+    if (!device->tx_congested && queued >= __atomic_load_n(&device->tx_limits.high_watermark, __ATOMIC_RELAXED)) {
+        congested = 1;
+        __NIC_STAT_ADD(queue->stats.tx_pauses, 1);
+    } else if (device->tx_congested && queued <= __atomic_load_n(&device->tx_limits.low_watermark, __ATOMIC_RELAXED)) {
+        congested = 0;
+    } else {
+        return;
+    }
+    device->tx_congested = congested;
+    nic_callback_set_t *set = __atomic_load_n(&device->tx_watermark_callbacks, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; set && i < set->count; i++) {
+        //Through void (*)(void): the entry only stores the pointer
+        ((nic_watermark_callback_t)(void (*)(void))set->callbacks[i])(queued, congested);
+    }
+}
+
+//Block until nic_send_packet() rings the TX doorbell
+static void __nic_tx_sleep(nic_queue_t *queue) {
+    nic_device_t *device = queue->device;
+    //Frames stuck in a full TX ring are retried on the next kick, do not sleep for long
+    int timeout = hal_tx_inflight(queue->hw_handle) ? HAL_POLL_TIMEOUT_MS : NIC_IDLE_TIMEOUT_MS;
+    //Announce the sleep, then re-check: a producer that enqueued before seeing
+    //sleeping set has its frame found here
+    __atomic_store_n(&queue->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (device->is_up && nic_ring_empty(device->tx_ring)) {
+        struct pollfd pfd = { .fd = queue->wake_fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout) > 0) {
+            uint64_t value;
+            if (read(queue->wake_fd, &value, sizeof(value)) < 0) {
+                //Already drained
             }
         }
+    }
+    __atomic_store_n(&queue->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+//After a loop iteration with nothing to do: non-zero if the thread should
+//sleep now, zero if it keeps polling (busy mode, or adaptive still spinning)
+static int __nic_idle(nic_device_t *device, uint64_t *spin_start) {
+    unsigned int mode = __atomic_load_n(&device->poll.mode, __ATOMIC_RELAXED);
+    if (mode == NIC_POLL_MODE_BUSY) {
+        return 0;
+    }
+    if (mode == NIC_POLL_MODE_ADAPTIVE) {
+        unsigned int spin_usecs = device->poll.spin_usecs ? device->poll.spin_usecs : NIC_DEFAULT_SPIN_USECS;
+        uint64_t now = __nic_now_us();
+        if (*spin_start == 0) {
+            *spin_start = now;
+        }
+        if (now - *spin_start < spin_usecs) {
+            return 0;
+        }
+    }
+    *spin_start = 0;
+    return 1;
+}
+
+//Pin a thread to cpu (-1 = any) and set its scheduling policy
+static status_t __nic_thread_setup(pthread_t thread, int cpu, int policy, int priority) {
+    status_t status = STATUS_OK;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (cpu >= 0) {
+        CPU_SET(cpu, &cpus);
+    } else {
+        long count = sysconf(_SC_NPROCESSORS_CONF);
+        for (long i = 0; i < count && i < CPU_SETSIZE; i++) {
+            CPU_SET(i, &cpus);
+        }
+    }
+    if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0) {
+        status = STATUS_ERROR;
+    }
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if (pthread_setschedparam(thread, policy, &param) != 0) {
+        status = STATUS_ERROR;
+    }
+    return status;
+}
+
+void __nic_thread(void * args) {
+    nic_queue_t *queue = (nic_queue_t *)args;
+    nic_device_t *device = queue->device;
+    //RX processing loop, one per queue
+    //1) drain up to NIC_RX_BURST frames from hardware, handing each one to the rx callbacks
+    //2) when there was nothing to do, spin or sleep in epoll depending on the poll mode
+    __nic_thread_setup(pthread_self(), queue->cpu, queue->sched_policy, queue->sched_priority);
+    __nic_rcu_quiescent(queue);
+    unsigned int frame_size = device->mtu+NIC_EXTRA_SIZE;
+    hal_frame_t rx_frames[NIC_RX_BURST];
+    int zero_copy = hal_is_zero_copy(queue->hw_handle);
+    uint64_t spin_start = 0;
+    unsigned char *rx_storage = NULL;
+    if (!zero_copy) {
+        rx_storage = (unsigned char *)malloc((size_t)NIC_RX_BURST * frame_size);
+        if (!rx_storage) {
+            __NIC_STAT_ADD(queue->stats.rx_errors, 1);
+            __nic_fire_error_callbacks(device);
+            __nic_rcu_offline(queue);
+            return;
+        }
+    }
+    while (device->is_up) {
+        __nic_rcu_quiescent(queue);
+        //Step 1: Receive a burst of packets from hardware
+        unsigned int rx_count = zero_copy ? __nic_receive_zc(queue, rx_frames)
+                                          : __nic_receive_batch(queue, rx_frames, rx_storage, frame_size);
+        //Step 2: Idle, spin or sleep until the hardware or the doorbell wakes us up
+        if (rx_count != 0) {
+            spin_start = 0;
+            continue;
+        }
+        if (__nic_idle(device, &spin_start)) {
+            __nic_rcu_offline(queue);
+            __nic_sleep(queue);
+        }
+    }
+    __nic_rcu_offline(queue);
+    free(rx_storage);
+}
+
+void __nic_tx_thread(void * args) {
+    nic_queue_t *queue = (nic_queue_t *)args;
+    nic_device_t *device = queue->device;
+    //TX processing loop, one per device
+    //1) send up to NIC_TX_BURST frames from the tx ring to hardware and update stats
+    //2) trigger tx callbacks as needed, from here and not from the RX workers
+    //3) when the ring is empty, spin or sleep on the doorbell depending on the poll mode
+    __nic_thread_setup(pthread_self(), queue->cpu, queue->sched_policy, queue->sched_priority);
+    flags_t internal_flags = __TX_FLAGS_NONE;
+    hal_frame_t tx_frames[NIC_TX_BURST];
+    nic_buffer_t tx_bufs[NIC_TX_BURST];
+    int tx_ring = hal_has_tx_ring(queue->hw_handle);
+    uint64_t spin_start = 0;
+    while (device->is_up) {
+        __nic_rcu_quiescent(queue);
+        __nic_tx_watermarks(queue);
+        __CLEAR_ALL_FLAGS(internal_flags);
+        //Step 1: Send a burst of packets from tx ring to hardware
+        unsigned int tx_count = tx_ring ? __nic_transmit_ring(queue, tx_bufs, &internal_flags)
+                                        : __nic_transmit_batch(queue, tx_bufs, tx_frames, &internal_flags);
+        //Step 2: Trigger callbacks based on internal flags
         if (__GET_TX_CB(internal_flags)) {
-            nic_callback_t *cb = device->tx_callbacks;
-            while (cb) {
-                if (cb->callback) cb->callback(NULL, 0);
-                cb = cb->next;
+            nic_callback_set_t *set = __atomic_load_n(&device->tx_callbacks, __ATOMIC_ACQUIRE);
+            for (unsigned int i = 0; set && i < set->count; i++) {
+                set->callbacks[i](NULL, 0);
             }
         }
-        //Sleep or yield to avoid busy waiting
-        usleep(1000); // Sleep for 1ms
+        //Step 3: Idle, spin or sleep until the doorbell wakes us up
+        if (tx_count != 0 || !nic_ring_empty(device->tx_ring)) {
+            spin_start = 0;
+            continue;
+        }
+        if (__nic_idle(device, &spin_start)) {
+            __nic_rcu_offline(queue);
+            __nic_tx_sleep(queue);
+        }
     }
+    __nic_rcu_offline(queue);
 }
 
 status_t __nic_thread_control(nic_device_t *device, int start) {
     if (start) {
         device->is_up = 1;
-        if (pthread_create(&device->thread, NULL, (void *)__nic_thread, (void *)device) != 0) {
+        for (unsigned int i = 0; i < device->queue_count; i++) {
+            if (pthread_create(&device->queues[i].thread, NULL, (void *)__nic_thread, (void *)&device->queues[i]) != 0) {
+                device->is_up = 0;
+                while (i--) {
+                    pthread_join(device->queues[i].thread, NULL);
+                }
+                return STATUS_ERROR;
+            }
+        }
+        if (pthread_create(&device->tx_queue.thread, NULL, (void *)__nic_tx_thread, (void *)&device->tx_queue) != 0) {
             device->is_up = 0;
+            for (unsigned int i = 0; i < device->queue_count; i++) {
+                __nic_wake_queue(&device->queues[i]);
+                pthread_join(device->queues[i].thread, NULL);
+            }
             return STATUS_ERROR;
         }
         return STATUS_OK;
     } else {
+        status_t status = STATUS_OK;
         device->is_up = 0;
-        if (pthread_join(device->thread, NULL) != 0) {
+        for (unsigned int i = 0; i < device->queue_count; i++) {
+            __nic_wake_queue(&device->queues[i]);
+        }
+        __nic_wake_queue(&device->tx_queue);
+        for (unsigned int i = 0; i < device->queue_count; i++) {
+            if (pthread_join(device->queues[i].thread, NULL) != 0) {
+                status = STATUS_ERROR;
+            }
+        }
+        if (pthread_join(device->tx_queue.thread, NULL) != 0) {
+            status = STATUS_ERROR;
+        }
+        return status;
+    }
+}
+
+//Rebuild the BPF program from the current addresses and ports and attach it
+//to every queue, or detach it when the filter is disabled
+static status_t __nic_update_filter(nic_device_t *device) {
+    hal_filter_insn_t prog[NIC_FILTER_MAX_INSNS];
+    unsigned int length = 0;
+    status_t status = STATUS_OK;
+    pthread_mutex_lock(&device->filter_lock);
+    memcpy(device->filter.mac, device->mac_address, 6);
+    device->filter.promiscuous = device->promiscuous_mode;
+    device->filter.ip_address = device->ip_address;
+    if (device->filter.enabled) {
+        length = nic_filter_build(&device->filter, prog, NIC_FILTER_MAX_INSNS);
+        if (length == 0) {
+            status = STATUS_ERROR;
+        }
+    }
+    for (unsigned int i = 0; status == STATUS_OK && i < device->queue_count; i++) {
+        if (hal_set_filter(device->queues[i].hw_handle, prog, length) < 0) {
+            status = STATUS_NOT_SUPPORTED;
+        }
+    }
+    pthread_mutex_unlock(&device->filter_lock);
+    return status;
+}
+
+static status_t __nic_filter_port(nic_device_t *device, uint16_t port, int add) {
+    nic_filter_t *filter = &device->filter;
+    pthread_mutex_lock(&device->filter_lock);
+    unsigned int i = 0;
+    while (i < filter->port_count && filter->tcp_ports[i] != port) {
+        i++;
+    }
+    if (add && i == filter->port_count) {
+        if (filter->port_count == NIC_FILTER_MAX_PORTS) {
+            pthread_mutex_unlock(&device->filter_lock);
             return STATUS_ERROR;
         }
+        filter->tcp_ports[filter->port_count++] = port;
+    } else if (!add && i < filter->port_count) {
+        filter->tcp_ports[i] = filter->tcp_ports[--filter->port_count];
+    }
+    pthread_mutex_unlock(&device->filter_lock);
+    return filter->enabled ? __nic_update_filter(device) : STATUS_OK;
+}
+
+static void __nic_remove_queues(nic_device_t *device) {
+    for (unsigned int i = 0; i < device->queue_count; i++) {
+        nic_queue_t *queue = &device->queues[i];
+        if (queue->epoll_fd >= 0) {
+            close(queue->epoll_fd);
+        }
+        if (queue->wake_fd >= 0) {
+            close(queue->wake_fd);
+        }
+        queue->epoll_fd = -1;
+        queue->wake_fd = -1;
+        hal_remove_device(queue->hw_handle);
+        queue->hw_handle = NULL;
+    }
+    if (device->tx_queue.wake_fd >= 0) {
+        close(device->tx_queue.wake_fd);
+    }
+    device->tx_queue.wake_fd = -1;
+    device->tx_queue.hw_handle = NULL;
+    device->hw_handle = NULL;
+}
+
+//epoll set of a queue: the HAL fd and the doorbell. A backend without fd leaves
+//epoll_fd at -1 and the worker falls back to hal_wait().
+static status_t __nic_queue_events(nic_queue_t *queue) {
+    int hal_fd = hal_get_fd(queue->hw_handle);
+    queue->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->wake_fd < 0) {
+        return STATUS_ERROR;
+    }
+    if (hal_fd < 0) {
         return STATUS_OK;
     }
+    queue->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (queue->epoll_fd < 0) {
+        return STATUS_ERROR;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = hal_fd;
+    if (epoll_ctl(queue->epoll_fd, EPOLL_CTL_ADD, hal_fd, &event) < 0) {
+        return STATUS_ERROR;
+    }
+    event.data.fd = queue->wake_fd;
+    if (epoll_ctl(queue->epoll_fd, EPOLL_CTL_ADD, queue->wake_fd, &event) < 0) {
+        return STATUS_ERROR;
+    }
+    return STATUS_OK;
+}
+
+//Open one HAL handle per queue. With several queues they all join the same
+//fanout group, so the kernel spreads flows over them like RSS does.
+static status_t __nic_create_queues(nic_device_t *device) {
+    static unsigned int fanout_groups = 0;
+    if (device->queue_count == 0) {
+        device->queue_count = 1;
+    }
+    if (device->queue_count > NIC_MAX_QUEUES) {
+        device->queue_count = NIC_MAX_QUEUES;
+    }
+    hal_config_t config = device->hal_config;
+    if (device->queue_count > 1 && config.fanout_mode == HAL_FANOUT_NONE) {
+        config.fanout_mode = HAL_FANOUT_HASH;
+    }
+    if (config.fanout_mode != HAL_FANOUT_NONE) {
+        config.fanout_group = (getpid() + __atomic_fetch_add(&fanout_groups, 1, __ATOMIC_RELAXED)) & 0xffff;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int xdp_queue = config.xdp_queue_id;
+    //AF_XDP queues share one XSKMAP per interface, sized for all of ours
+    if (config.xdp_queue_count < xdp_queue + device->queue_count) {
+        config.xdp_queue_count = xdp_queue + device->queue_count;
+    }
+    device->tx_queue.wake_fd = -1;
+
+    for (unsigned int i = 0; i < device->queue_count; i++) {
+        nic_queue_t *queue = &device->queues[i];
+        memset(queue, 0, sizeof(nic_queue_t));
+        queue->device = device;
+        queue->id = i;
+        queue->cpu = (device->queue_count > 1 && cpus > 0) ? (int)(i % cpus) : -1;
+        queue->sched_policy = SCHED_OTHER;
+        queue->epoll_fd = -1;
+        queue->wake_fd = -1;
+        config.xdp_queue_id = xdp_queue + i;
+        queue->hw_handle = hal_create_device(&config);
+        if (!queue->hw_handle || __nic_queue_events(queue) != STATUS_OK) {
+            device->queue_count = queue->hw_handle ? i + 1 : i;
+            __nic_remove_queues(device);
+            return STATUS_ERROR;
+        }
+        if (device->poll.busy_poll_usecs > 0) {
+            //Best effort here, NIC_IOCTL_SET_POLL_MODE reports the failure
+            hal_set_busy_poll(queue->hw_handle, device->poll.busy_poll_usecs);
+        }
+    }
+    device->hal_config.fanout_mode = config.fanout_mode;
+    device->hal_config.fanout_group = config.fanout_group;
+    device->hw_handle = device->queues[0].hw_handle;
+
+    //The TX thread sends through queue 0's handle and only sleeps on its doorbell
+    nic_queue_t *tx_queue = &device->tx_queue;
+    memset(tx_queue, 0, sizeof(nic_queue_t));
+    tx_queue->device = device;
+    tx_queue->hw_handle = device->hw_handle;
+    tx_queue->cpu = -1;
+    tx_queue->sched_policy = SCHED_OTHER;
+    tx_queue->epoll_fd = -1;
+    tx_queue->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (tx_queue->wake_fd < 0) {
+        __nic_remove_queues(device);
+        return STATUS_ERROR;
+    }
+    return STATUS_OK;
 }
 
 status_t nic_init(nic_device_t *device) {
@@ -166,33 +920,78 @@ status_t nic_init(nic_device_t *device) {
         device->mac_address[i] = default_mac[i];
     }
 
-    // Set statistics to zero
-    device->stats.tx_packets = 0;
-    device->stats.rx_packets = 0;
-    device->stats.tx_errors = 0;
-    device->stats.rx_errors = 0;
-    device->stats.collisions = 0;
+    // The interface comes from hal_config.ifname or, failing that, device->name
+    if (!device->hal_config.ifname[0]) {
+        snprintf(device->hal_config.ifname, HAL_IFACE_NAMELEN, "%s", device->name);
+    }
+    if (!device->hal_config.ifname[0]) {
+        return STATUS_INVALID_PARAM;
+    }
+    snprintf(device->name, sizeof(device->name), "%s", device->hal_config.ifname);
 
-    // Set underlying hardware handle
-    device->hw_handle = hal_create_device();
-    if (!device->hw_handle) {
+    // Set underlying hardware handles (one per queue, statistics start at zero),
+    // through the backend selected in hal_config
+    if (__nic_create_queues(device) != STATUS_OK) {
         return STATUS_ERROR;
     }
     device->mtu = hal_get_mtu(device->hw_handle);
     hal_get_mac_address(device->hw_handle, device->mac_address);
 
     // Initialize internal buffers and callback lists to NULL
-    device->rx_buffer = NULL;
-    device->tx_buffer = NULL;
+    device->rx_head = 0;
+    device->rx_count = 0;
+    if (device->rx_ring_size == 0) {
+        device->rx_ring_size = NIC_RX_RING_SIZE;
+    }
     device->rx_callbacks = NULL;
+    device->rx_burst_callbacks = NULL;
     device->tx_callbacks = NULL;
     device->error_callbacks = NULL;
+    device->tx_watermark_callbacks = NULL;
+    device->retired_callbacks = NULL;
+    device->rcu_epoch = 1;
+    memset(device->ethertypes, 0, sizeof(device->ethertypes));
+    memset(device->stats_shards, 0, sizeof(device->stats_shards));
+    device->pool = nic_mbuf_pool_create(device->pool_size ? device->pool_size : NIC_MBUF_POOL_SIZE, 0, device->pool_flags);
+    device->tx_ring = nic_ring_create(device->tx_ring_size ? device->tx_ring_size : NIC_TX_RING_SIZE, sizeof(nic_buffer_t));
+    device->rx_ring = calloc(device->rx_ring_size, sizeof(nic_mbuf_t *));
+    nic_tx_limits_t tx_limits = device->tx_limits;
+    device->tx_congested = 0;
+    device->tx_queued = 0;
+    if (!device->pool || !device->tx_ring || !device->rx_ring || __nic_set_tx_limits(device, &tx_limits) != STATUS_OK) {
+        __nic_remove_queues(device);
+        nic_mbuf_pool_free(device->pool);
+        nic_ring_free(device->tx_ring);
+        free(device->rx_ring);
+        device->pool = NULL;
+        device->tx_ring = NULL;
+        device->rx_ring = NULL;
+        return STATUS_ERROR;
+    }
+    pthread_mutex_init(&device->rx_lock, NULL);
+    pthread_mutex_init(&device->callback_lock, NULL);
+    // Readers wait with a monotonic deadline
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&device->rx_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    device->rx_waiters = 0;
+    pthread_mutex_init(&device->filter_lock, NULL);
+    memset(&device->filter, 0, sizeof(nic_filter_t));
 
-    // Init the thread for NIC processing
+    // Init the threads for NIC processing, one per queue
     device->is_up = 0;
     if (__nic_thread_control(device, 1) != STATUS_OK) {
-        hal_remove_device(device->hw_handle);
-        device->hw_handle = NULL;
+        __nic_remove_queues(device);
+        nic_ring_free(device->tx_ring);
+        nic_mbuf_pool_free(device->pool);
+        free(device->rx_ring);
+        pthread_cond_destroy(&device->rx_cond);
+        pthread_mutex_destroy(&device->callback_lock);
+        device->tx_ring = NULL;
+        device->pool = NULL;
+        device->rx_ring = NULL;
         return STATUS_ERROR;
     }
 
@@ -211,41 +1010,40 @@ status_t nic_shutdown(nic_device_t *device) {
         return STATUS_ERROR;
     }
 
-    // Free internal buffers
-    nic_buffer_t *buf;
-    while (device->rx_buffer) {
-        buf = device->rx_buffer;
-        device->rx_buffer = buf->next;
-        free(buf->data);
-        free(buf);
-    }
-    while (device->tx_buffer) {
-        buf = device->tx_buffer;
-        device->tx_buffer = buf->next;
-        free(buf->data);
-        free(buf);
-    }
-    // Free callback lists
-    nic_callback_t *cb;
-    while (device->rx_callbacks) {
-        cb = device->rx_callbacks;
-        device->rx_callbacks = cb->next;
-        free(cb);
-    }
-    while (device->tx_callbacks) {
-        cb = device->tx_callbacks;
-        device->tx_callbacks = cb->next;
-        free(cb);
-    }
-    while (device->error_callbacks) {
-        cb = device->error_callbacks;
-        device->error_callbacks = cb->next;
-        free(cb);
-    }
-
-    // Remove hardware handle
-    hal_remove_device(device->hw_handle);
-    device->hw_handle = NULL;
+    // Free internal buffers, then the pool they come from
+    for (; device->rx_count > 0; device->rx_count--) {
+        nic_mbuf_free(device->rx_ring[device->rx_head]);
+        device->rx_head = (device->rx_head + 1) % device->rx_ring_size;
+    }
+    free(device->rx_ring);
+    device->rx_ring = NULL;
+    nic_buffer_t tx_buf;
+    while (nic_ring_dequeue(device->tx_ring, &tx_buf) == 1) {
+        nic_mbuf_free(tx_buf.mbuf);
+    }
+    device->tx_queued = 0;
+    nic_ring_free(device->tx_ring);
+    device->tx_ring = NULL;
+    nic_mbuf_pool_free(device->pool);
+    device->pool = NULL;
+    // Free callback lists, no thread is left to hold a snapshot
+    __nic_free_callbacks(&device->rx_callbacks);
+    __nic_free_callbacks(&device->rx_burst_callbacks);
+    __nic_free_callbacks(&device->tx_callbacks);
+    __nic_free_callbacks(&device->error_callbacks);
+    __nic_free_callbacks(&device->tx_watermark_callbacks);
+    __nic_rcu_reclaim(device, UINT64_MAX);
+    pthread_mutex_destroy(&device->callback_lock);
+    for (int i = 0; i < NIC_ETHERTYPE_PAGES; i++) {
+        free(device->ethertypes[i]);
+        device->ethertypes[i] = NULL;
+    }
+
+    // Remove hardware handles
+    __nic_remove_queues(device);
+    pthread_mutex_destroy(&device->rx_lock);
+    pthread_cond_destroy(&device->rx_cond);
+    pthread_mutex_destroy(&device->filter_lock);
 
     // Additional shutdown code here
     return STATUS_OK;
@@ -260,7 +1058,7 @@ status_t nic_ioctl(nic_device_t *device, unsigned int command, void *arg) {
             for (int i = 0; i < 6; i++) {
                 device->mac_address[i] = ((unsigned char *)arg)[i];
             }
-            return STATUS_OK;
+            return device->filter.enabled ? __nic_update_filter(device) : STATUS_OK;
         }
         case NIC_IOCTL_SET_MTU: {
             if (!device || !arg) {
@@ -273,62 +1071,119 @@ status_t nic_ioctl(nic_device_t *device, unsigned int command, void *arg) {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            *(nic_stats_t *)arg = device->stats;
+            nic_stats_t *stats = (nic_stats_t *)arg;
+            memset(stats, 0, sizeof(nic_stats_t));
+            for (unsigned int i = 0; i < device->queue_count; i++) {
+                __nic_stats_add(stats, &device->queues[i].stats);
+            }
+            __nic_stats_add(stats, &device->tx_queue.stats);
+            for (unsigned int i = 0; i < NIC_STATS_SHARDS; i++) {
+                for (unsigned int j = 0; j < NIC_DROP_REASONS; j++) {
+                    stats->drops[j] += __atomic_load_n(&device->stats_shards[i].drops[j], __ATOMIC_RELAXED);
+                }
+            }
+            __nic_stats_totals(stats);
+            stats->tx_queue_depth = device->tx_ring ? nic_ring_count(device->tx_ring) : 0;
+            stats->mbuf_in_use = nic_mbuf_pool_in_use(device->pool);
+            stats->mbuf_count = device->pool ? device->pool->count : 0;
+            pthread_mutex_lock(&device->rx_lock);
+            stats->rx_queue_depth = device->rx_count;
+            pthread_mutex_unlock(&device->rx_lock);
+            return STATUS_OK;
+        }
+        case NIC_IOCTL_GET_QUEUE_STATS: {
+            nic_queue_stats_t *queue_stats = (nic_queue_stats_t *)arg;
+            if (!device || !arg || queue_stats->queue >= device->queue_count) {
+                return STATUS_INVALID_PARAM;
+            }
+            memset(&queue_stats->stats, 0, sizeof(nic_stats_t));
+            __nic_stats_add(&queue_stats->stats, &device->queues[queue_stats->queue].stats);
+            __nic_stats_totals(&queue_stats->stats);
             return STATUS_OK;
         }
         case NIC_IOCTL_RESET_STATS: {
             if (!device) {
                 return STATUS_INVALID_PARAM;
             }
-            device->stats.tx_packets = 0;
-            device->stats.rx_packets = 0;
-            device->stats.tx_errors = 0;
-            device->stats.rx_errors = 0;
-            device->stats.collisions = 0;
+            for (unsigned int i = 0; i < device->queue_count; i++) {
+                memset(&device->queues[i].stats, 0, sizeof(nic_stats_t));
+            }
+            memset(&device->tx_queue.stats, 0, sizeof(nic_stats_t));
+            memset(device->stats_shards, 0, sizeof(device->stats_shards));
             return STATUS_OK;
         }
         case NIC_IOCTL_ADD_RX_CALLBACK: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            return __nic_add_callback(&device->rx_callbacks, (nic_event_callback_t)arg);
+            return __nic_update_callbacks(device, &device->rx_callbacks, (nic_event_callback_t)arg, 1);
         }
         case NIC_IOCTL_REMOVE_RX_CALLBACK: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            return __nic_remove_callback(&device->rx_callbacks, (nic_event_callback_t)arg);
+            return __nic_update_callbacks(device, &device->rx_callbacks, (nic_event_callback_t)arg, 0);
+        }
+        case NIC_IOCTL_ADD_RX_BURST_CALLBACK: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            return __nic_update_callbacks(device, &device->rx_burst_callbacks, (nic_event_callback_t)arg, 1);
+        }
+        case NIC_IOCTL_REMOVE_RX_BURST_CALLBACK: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            return __nic_update_callbacks(device, &device->rx_burst_callbacks, (nic_event_callback_t)arg, 0);
         }
         case NIC_IOCTL_ADD_TX_CALLBACK: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            return __nic_add_callback(&device->tx_callbacks, (nic_event_callback_t)arg);
+            return __nic_update_callbacks(device, &device->tx_callbacks, (nic_event_callback_t)arg, 1);
         }
         case NIC_IOCTL_REMOVE_TX_CALLBACK: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            return __nic_remove_callback(&device->tx_callbacks, (nic_event_callback_t)arg);
+            return __nic_update_callbacks(device, &device->tx_callbacks, (nic_event_callback_t)arg, 0);
         }
         case NIC_IOCTL_ADD_ERROR_CALLBACK: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            return __nic_add_callback(&device->error_callbacks, (nic_event_callback_t )arg);
+            return __nic_update_callbacks(device, &device->error_callbacks, (nic_event_callback_t )arg, 1);
         }
         case NIC_IOCTL_REMOVE_ERROR_CALLBACK: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            return __nic_remove_callback(&device->error_callbacks, (nic_event_callback_t)arg);
+            return __nic_update_callbacks(device, &device->error_callbacks, (nic_event_callback_t)arg, 0);
+        }
+        case NIC_IOCTL_ADD_TX_WATERMARK_CALLBACK: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            return __nic_update_callbacks(device, &device->tx_watermark_callbacks, (nic_event_callback_t)arg, 1);
+        }
+        case NIC_IOCTL_REMOVE_TX_WATERMARK_CALLBACK: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            return __nic_update_callbacks(device, &device->tx_watermark_callbacks, (nic_event_callback_t)arg, 0);
+        }
+        case NIC_IOCTL_SET_TX_LIMITS: {
+            if (!device || !arg || !device->tx_ring) {
+                return STATUS_INVALID_PARAM;
+            }
+            return __nic_set_tx_limits(device, (const nic_tx_limits_t *)arg);
         }
         case NIC_IOCTL_SET_PROMISCUOUS_MODE: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
             device->promiscuous_mode = *(unsigned short *)arg;
-            return STATUS_OK;
+            return device->filter.enabled ? __nic_update_filter(device) : STATUS_OK;
         }
         case NIC_IOCTL_UP: {
             if (!device) {
@@ -336,6 +1191,110 @@ status_t nic_ioctl(nic_device_t *device, unsigned int command, void *arg) {
             }
             return __nic_thread_control(device, 1);
         }
+        case NIC_IOCTL_SET_QDISC_BYPASS: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            device->hal_config.tx_qdisc_bypass = *(int *)arg;
+            for (unsigned int i = 0; i < device->queue_count; i++) {
+                if (hal_set_qdisc_bypass(device->queues[i].hw_handle, device->hal_config.tx_qdisc_bypass) < 0) {
+                    return STATUS_NOT_SUPPORTED;
+                }
+            }
+            return STATUS_OK;
+        }
+        case NIC_IOCTL_GET_OFFLOADS: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            *(unsigned int *)arg = device->hw_handle ? hal_get_offloads(device->hw_handle) : 0;
+            return STATUS_OK;
+        }
+        case NIC_IOCTL_SET_FILTER: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            device->filter.enabled = *(int *)arg;
+            return __nic_update_filter(device);
+        }
+        case NIC_IOCTL_ADD_FILTER_PORT:
+        case NIC_IOCTL_REMOVE_FILTER_PORT: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            return __nic_filter_port(device, *(uint16_t *)arg, command == NIC_IOCTL_ADD_FILTER_PORT);
+        }
+        case NIC_IOCTL_SET_IP_ADDRESS: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            device->ip_address = *(uint32_t *)arg;
+            return device->filter.enabled ? __nic_update_filter(device) : STATUS_OK;
+        }
+        case NIC_IOCTL_SET_POLL_MODE: {
+            nic_poll_config_t *poll = (nic_poll_config_t *)arg;
+            if (!device || !arg || poll->mode > NIC_POLL_MODE_ADAPTIVE || poll->busy_poll_usecs < 0) {
+                return STATUS_INVALID_PARAM;
+            }
+            int busy_poll_changed = poll->busy_poll_usecs != device->poll.busy_poll_usecs;
+            device->poll.spin_usecs = poll->spin_usecs;
+            device->poll.busy_poll_usecs = poll->busy_poll_usecs;
+            __atomic_store_n(&device->poll.mode, poll->mode, __ATOMIC_RELAXED);
+            //A worker asleep in event mode picks the new mode up once woken
+            for (unsigned int i = 0; i < device->queue_count; i++) {
+                __nic_wake_queue(&device->queues[i]);
+            }
+            __nic_wake_queue(&device->tx_queue);
+            for (unsigned int i = 0; busy_poll_changed && i < device->queue_count; i++) {
+                if (hal_set_busy_poll(device->queues[i].hw_handle, poll->busy_poll_usecs) < 0) {
+                    return STATUS_NOT_SUPPORTED;
+                }
+            }
+            return STATUS_OK;
+        }
+        case NIC_IOCTL_SET_RX_DROP_POLICY: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            unsigned int policy = *(unsigned int *)arg;
+            if (policy != NIC_RX_DROP_TAIL && policy != NIC_RX_DROP_HEAD) {
+                return STATUS_INVALID_PARAM;
+            }
+            __atomic_store_n(&device->rx_drop_policy, policy, __ATOMIC_RELAXED);
+            return STATUS_OK;
+        }
+        case NIC_IOCTL_SET_THREAD_AFFINITY:
+        case NIC_IOCTL_SET_THREAD_SCHED: {
+            nic_thread_config_t *config = (nic_thread_config_t *)arg;
+            if (!device || !arg || (config->thread != NIC_THREAD_TX &&
+                (config->thread < 0 || (unsigned int)config->thread >= device->queue_count))) {
+                return STATUS_INVALID_PARAM;
+            }
+            nic_queue_t *queue = config->thread == NIC_THREAD_TX ? &device->tx_queue : &device->queues[config->thread];
+            int cpu = queue->cpu;
+            int policy = queue->sched_policy;
+            int priority = queue->sched_priority;
+            if (command == NIC_IOCTL_SET_THREAD_AFFINITY) {
+                if (config->cpu < -1 || config->cpu >= CPU_SETSIZE) {
+                    return STATUS_INVALID_PARAM;
+                }
+                cpu = config->cpu;
+            } else {
+                if (config->policy != SCHED_OTHER && config->policy != SCHED_FIFO && config->policy != SCHED_RR) {
+                    return STATUS_INVALID_PARAM;
+                }
+                policy = config->policy;
+                priority = config->policy == SCHED_OTHER ? 0 : config->priority;
+            }
+            //Keep the settings only if the running thread accepted them
+            if (device->is_up && __nic_thread_setup(queue->thread, cpu, policy, priority) != STATUS_OK) {
+                return STATUS_ERROR;
+            }
+            queue->cpu = cpu;
+            queue->sched_policy = policy;
+            queue->sched_priority = priority;
+            return STATUS_OK;
+        }
         case NIC_IOCTL_DOWN: {
             if (!device) {
                 return STATUS_INVALID_PARAM;
@@ -347,71 +1306,238 @@ status_t nic_ioctl(nic_device_t *device, unsigned int command, void *arg) {
     }
 }
         
-status_t nic_send_packet(nic_device_t *device, const void *data, unsigned int length) {
-    // Send a packet through the NIC by writing to the tx buffer
-    if (!device || !data || length == 0 || length > device->mtu+NIC_EXTRA_SIZE) {
+//Hand a frame to the TX ring by reference, the ring owns the mbuf from here on
+static status_t __nic_enqueue_tx(nic_device_t *device, nic_mbuf_t *mbuf, const hal_offload_t *offload) {
+    nic_buffer_t tx_buf;
+    tx_buf.mbuf = mbuf;
+    if (offload) {
+        tx_buf.offload = *offload;
+    } else {
+        memset(&tx_buf.offload, 0, sizeof(hal_offload_t));
+    }
+    //Backpressure: reserve a place under the limit first, so concurrent senders
+    //cannot all pass the check and overshoot it. Past the limit the frame is
+    //dropped and STATUS_BUSY tells the caller to slow down until it drains.
+    unsigned int limit = __atomic_load_n(&device->tx_limits.limit, __ATOMIC_RELAXED);
+    unsigned int queued = __atomic_load_n(&device->tx_queued, __ATOMIC_RELAXED);
+    do {
+        if (queued >= limit) {
+            nic_mbuf_free(mbuf);
+            __nic_count_drop(device, NIC_DROP_TX_RING_FULL);
+            return STATUS_BUSY;
+        }
+    } while (!__atomic_compare_exchange_n(&device->tx_queued, &queued, queued + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    if (nic_ring_enqueue(device->tx_ring, &tx_buf) < 0) {
+        __atomic_fetch_sub(&device->tx_queued, 1, __ATOMIC_RELAXED);
+        nic_mbuf_free(mbuf);
+        __nic_count_drop(device, NIC_DROP_TX_RING_FULL);
+        return STATUS_BUSY;
+    }
+    //Pairs with the store of sleeping in __nic_tx_sleep(): either the TX thread
+    //sees the new descriptor or we see it asleep and ring the doorbell
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    __nic_wake_queue(&device->tx_queue);
+
+    return STATUS_OK;
+}
+
+//Length and offload checks shared by every TX entry point
+static status_t __nic_check_tx(nic_device_t *device, unsigned int length, const hal_offload_t *offload) {
+    if (!device || !device->hw_handle) {
         return STATUS_INVALID_PARAM;
     }
+    status_t status = STATUS_OK;
+    if (length == 0) {
+        status = STATUS_INVALID_PARAM;
+    } else if (!offload || offload->flags == 0) {
+        status = length > device->mtu+NIC_EXTRA_SIZE ? STATUS_INVALID_PARAM : STATUS_OK;
+    } else if (offload->flags & ~hal_get_offloads(device->hw_handle)) {
+        status = STATUS_NOT_SUPPORTED;
+    } else {
+        // A TSO super-frame may exceed the MTU, the hardware cuts it down
+        unsigned int max_length = (offload->flags & HAL_OFFLOAD_TSO4) ? HAL_GSO_MAX_SIZE : device->mtu+NIC_EXTRA_SIZE;
+        if (length > max_length || offload->csum_start + offload->csum_offset + 2u > length) {
+            status = STATUS_INVALID_PARAM;
+        }
+    }
+    if (status != STATUS_OK) {
+        __nic_count_drop(device, NIC_DROP_TX_INVALID);
+    }
+    return status;
+}
 
-    nic_buffer_t *new_tx_buffer = (nic_buffer_t *)malloc(sizeof(nic_buffer_t));
-    if (!new_tx_buffer) {
+static status_t __nic_queue_tx(nic_device_t *device, const void *data, unsigned int length, const hal_offload_t *offload) {
+    status_t status = __nic_check_tx(device, length, offload);
+    if (status != STATUS_OK || !data) {
+        return status != STATUS_OK ? status : STATUS_INVALID_PARAM;
+    }
+    nic_mbuf_t *mbuf = nic_mbuf_alloc(device->pool, length);
+    if (!mbuf) {
+        __nic_count_drop(device, NIC_DROP_TX_NO_MBUF);
         return STATUS_ERROR;
     }
+    memcpy(nic_mbuf_data(mbuf), data, length);
+    return __nic_enqueue_tx(device, mbuf, offload);
+}
 
-    new_tx_buffer->data = malloc(length);
-    if (!new_tx_buffer->data) {
-        free(new_tx_buffer);
-        return STATUS_ERROR;
+status_t nic_send_packet(nic_device_t *device, const void *data, unsigned int length) {
+    // Send a packet through the NIC by writing to the tx buffer
+    return __nic_queue_tx(device, data, length, NULL);
+}
+
+status_t nic_send_packet_offload(nic_device_t *device, const void *data, unsigned int length, const hal_offload_t *offload) {
+    return __nic_queue_tx(device, data, length, offload);
+}
+
+status_t nic_send_mbuf(nic_device_t *device, nic_mbuf_t *mbuf, const hal_offload_t *offload) {
+    if (!mbuf) {
+        return STATUS_INVALID_PARAM;
     }
-    memcpy(new_tx_buffer->data, data, length);
-    new_tx_buffer->length = length;
-    new_tx_buffer->next = NULL;
-    // Append to the end of the tx buffer list
-    if (!device->tx_buffer) {
-        device->tx_buffer = new_tx_buffer;
-    } else {
-        nic_buffer_t *tx_buf = device->tx_buffer;
-        while (tx_buf->next) {
-            tx_buf = tx_buf->next;
-        }
-        tx_buf->next = new_tx_buffer;
+    status_t status = __nic_check_tx(device, mbuf->length, offload);
+    if (status != STATUS_OK) {
+        nic_mbuf_free(mbuf);
+        return status;
     }
+    return __nic_enqueue_tx(device, mbuf, offload);
+}
 
+status_t nic_register_ethertype_handler(nic_device_t *device, uint16_t ethertype, nic_ethertype_handler_t handler) {
+    if (!device) {
+        return STATUS_INVALID_PARAM;
+    }
+    nic_ethertype_handler_t **slot = &device->ethertypes[ethertype >> 8];
+    nic_ethertype_handler_t *page = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (!page) {
+        if (!handler) {
+            return STATUS_OK;
+        }
+        page = calloc(256, sizeof(nic_ethertype_handler_t));
+        if (!page) {
+            return STATUS_ERROR;
+        }
+        // Another thread may have installed the page meanwhile, keep theirs
+        nic_ethertype_handler_t *expected = NULL;
+        if (!__atomic_compare_exchange_n(slot, &expected, page, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(page);
+            page = expected;
+        }
+    }
+    // Workers pick the new handler up with their next frame
+    __atomic_store_n(&page[ethertype & 0xff], handler, __ATOMIC_RELEASE);
     return STATUS_OK;
 }
 
-status_t nic_receive_packet(nic_device_t *device, void *buffer, unsigned int buffer_length) {
-    // Receive a packet from the NIC by reading from the rx buffer
+//Called with rx_lock held. Waits until the FIFO has a frame or timeout_ms
+//(-1 = forever) has passed, returns non-zero if there is one.
+static int __nic_rx_wait(nic_device_t *device, int timeout_ms) {
+    if (device->rx_count > 0 || timeout_ms == 0) {
+        return device->rx_count > 0;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    device->rx_waiters++;
+    while (device->rx_count == 0) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&device->rx_cond, &device->rx_lock);
+        } else if (pthread_cond_timedwait(&device->rx_cond, &device->rx_lock, &deadline) != 0) {
+            break;  // Timed out
+        }
+    }
+    device->rx_waiters--;
+    return device->rx_count > 0;
+}
+
+status_t nic_receive_packet_timeout(nic_device_t *device, void *buffer, unsigned int buffer_length, int timeout_ms) {
+    // Receive the oldest packet from the NIC rx FIFO
     if (!device || !buffer || buffer_length == 0) {
         return STATUS_INVALID_PARAM;
     }
 
-    if (!device->rx_buffer) {
+    pthread_mutex_lock(&device->rx_lock);
+    if (!__nic_rx_wait(device, timeout_ms)) {
+        pthread_mutex_unlock(&device->rx_lock);
         return STATUS_NOT_SUPPORTED; // No packets available
     }
 
-    nic_buffer_t *rx_buf = device->rx_buffer;
+    nic_mbuf_t *rx_buf = device->rx_ring[device->rx_head];
     if (rx_buf->length > buffer_length) {
+        pthread_mutex_unlock(&device->rx_lock);
         return STATUS_INVALID_PARAM; // Buffer too small
     }
 
-    memcpy(buffer, rx_buf->data, rx_buf->length);
-    unsigned int received_length = rx_buf->length;
+    // Remove the buffer from the rx FIFO
+    device->rx_head = (device->rx_head + 1) % device->rx_ring_size;
+    device->rx_count--;
+    pthread_mutex_unlock(&device->rx_lock);
 
-    // Remove the buffer from the rx list
-    device->rx_buffer = rx_buf->next;
-    free(rx_buf->data);
-    free(rx_buf);
+    memcpy(buffer, nic_mbuf_data(rx_buf), rx_buf->length);
+    unsigned int received_length = rx_buf->length;
+    nic_mbuf_free(rx_buf);
 
     return received_length;
 }
 
+status_t nic_receive_packet(nic_device_t *device, void *buffer, unsigned int buffer_length) {
+    return nic_receive_packet_timeout(device, buffer, buffer_length, 0);
+}
+
+int nic_receive_batch(nic_device_t *device, hal_frame_t *frames, unsigned int count, int timeout_ms) {
+    if (!device || !frames || count == 0) {
+        return STATUS_INVALID_PARAM;
+    }
+    if (count > NIC_RX_BURST) {
+        count = NIC_RX_BURST;
+    }
+
+    // Take the frames under the lock, copy them out after releasing it
+    nic_mbuf_t *rx_bufs[NIC_RX_BURST];
+    unsigned int taken = 0;
+    pthread_mutex_lock(&device->rx_lock);
+    if (__nic_rx_wait(device, timeout_ms)) {
+        for (; taken < count && device->rx_count > 0; taken++) {
+            rx_bufs[taken] = device->rx_ring[device->rx_head];
+            device->rx_head = (device->rx_head + 1) % device->rx_ring_size;
+            device->rx_count--;
+        }
+    }
+    pthread_mutex_unlock(&device->rx_lock);
+
+    for (unsigned int i = 0; i < taken; i++) {
+        nic_mbuf_t *rx_buf = rx_bufs[i];
+        frames[i].timestamp = rx_buf->timestamp;
+        frames[i].flags = rx_buf->flags;
+        frames[i].vlan_tci = rx_buf->vlan_tci;
+        frames[i].vlan_tpid = rx_buf->vlan_tpid;
+        unsigned int length = rx_buf->length;
+        if (length > frames[i].length) {
+            //Too long for the caller's buffer: hand over the head, flagged
+            length = frames[i].length;
+            frames[i].flags |= HAL_FRAME_TRUNCATED;
+            __nic_count_drop(device, NIC_DROP_RX_TRUNCATED);
+        }
+        memcpy(frames[i].data, nic_mbuf_data(rx_buf), length);
+        frames[i].length = length;
+        nic_mbuf_free(rx_buf);
+    }
+    return taken;
+}
+
 nic_driver_t nic_driver = {
     .init = nic_init,
     .shutdown = nic_shutdown,
     .send_packet = nic_send_packet,
     .receive_packet = nic_receive_packet,
-    .ioctl = nic_ioctl
+    .ioctl = nic_ioctl,
+    .send_packet_offload = nic_send_packet_offload,
+    .send_mbuf = nic_send_mbuf,
+    .receive_packet_timeout = nic_receive_packet_timeout,
+    .receive_batch = nic_receive_batch
 };
 
 nic_driver_t * nic_get_driver() {
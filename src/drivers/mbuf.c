@@ -0,0 +1,113 @@
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "drivers/mbuf.h"
+
+#define __MBUF_HUGEPAGE_SIZE    (2UL << 20)
+
+static unsigned char * __mbuf_map(size_t size, int hugepage) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+    if (hugepage) {
+        flags |= MAP_HUGETLB;
+    }
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return memory == MAP_FAILED ? NULL : (unsigned char *)memory;
+}
+
+nic_mbuf_pool_t * nic_mbuf_pool_create(unsigned int count, unsigned int data_room, unsigned int flags) {
+    if (count == 0) {
+        return NULL;
+    }
+    nic_mbuf_pool_t *pool = malloc(sizeof(nic_mbuf_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(nic_mbuf_pool_t));
+    pool->count = count;
+    pool->data_room = data_room ? data_room : NIC_MBUF_DATA_ROOM;
+    pool->stride = (sizeof(nic_mbuf_t) + NIC_MBUF_HEADROOM + pool->data_room + 63) & ~63u;
+
+    // Everything is mapped and touched up front (MAP_POPULATE): no page
+    // faults on the packet path. Huge pages also cut the TLB misses, but need
+    // pages reserved in /proc/sys/vm/nr_hugepages, so fall back without them.
+    size_t size = (size_t)count * pool->stride;
+    if (flags & NIC_MBUF_F_HUGEPAGE) {
+        pool->memory_size = (size + __MBUF_HUGEPAGE_SIZE - 1) & ~(__MBUF_HUGEPAGE_SIZE - 1);
+        pool->memory = __mbuf_map(pool->memory_size, 1);
+        pool->hugepage = pool->memory != NULL;
+    }
+    if (!pool->memory) {
+        pool->memory_size = size;
+        pool->memory = __mbuf_map(size, 0);
+    }
+    // Room for every buffer, so nic_mbuf_free() never finds the ring full
+    pool->free = nic_ring_create(count, sizeof(nic_mbuf_t *));
+    if (!pool->memory || !pool->free) {
+        nic_mbuf_pool_free(pool);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        nic_mbuf_t *mbuf = (nic_mbuf_t *)(pool->memory + (size_t)i * pool->stride);
+        mbuf->pool = pool;
+        mbuf->buf_len = NIC_MBUF_HEADROOM + pool->data_room;
+        nic_ring_enqueue(pool->free, &mbuf);
+    }
+    return pool;
+}
+
+void nic_mbuf_pool_free(nic_mbuf_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    if (pool->memory) {
+        munmap(pool->memory, pool->memory_size);
+    }
+    nic_ring_free(pool->free);
+    free(pool);
+}
+
+unsigned int nic_mbuf_pool_in_use(nic_mbuf_pool_t *pool) {
+    return pool ? pool->count - nic_ring_count(pool->free) : 0;
+}
+
+nic_mbuf_t * nic_mbuf_alloc(nic_mbuf_pool_t *pool, unsigned int length) {
+    nic_mbuf_t *mbuf = NULL;
+    if (pool && length <= pool->data_room) {
+        if (nic_ring_dequeue_mc(pool->free, &mbuf) != 1) {
+            return NULL;
+        }
+    } else {
+        // Larger than any pool buffer (TSO super-frames): one-off allocation
+        if (posix_memalign((void **)&mbuf, 64, sizeof(nic_mbuf_t) + NIC_MBUF_HEADROOM + length) != 0) {
+            return NULL;
+        }
+        mbuf->pool = NULL;
+        mbuf->buf_len = NIC_MBUF_HEADROOM + length;
+    }
+    mbuf->next = NULL;
+    mbuf->refcnt = 1;
+    mbuf->data_off = NIC_MBUF_HEADROOM;
+    mbuf->length = length;
+    mbuf->timestamp = 0;
+    mbuf->flags = 0;
+    mbuf->vlan_tci = 0;
+    mbuf->vlan_tpid = 0;
+    return mbuf;
+}
+
+void nic_mbuf_ref(nic_mbuf_t *mbuf) {
+    __atomic_fetch_add(&mbuf->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void nic_mbuf_free(nic_mbuf_t *mbuf) {
+    if (!mbuf || __atomic_sub_fetch(&mbuf->refcnt, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    if (mbuf->pool) {
+        nic_ring_enqueue(mbuf->pool->free, &mbuf);
+    } else {
+        free(mbuf);
+    }
+}
@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "drivers/ring.h"
+
+// Every slot starts with a sequence number. Slot i is free for the producer
+// that claims position pos when seq == pos, and holds a published element for
+// the consumer when seq == pos + 1. Reading it sets seq to pos + size, which
+// frees it for the next lap.
+#define __RING_SLOT(ring, pos)  ((uint32_t *)((ring)->slots + (size_t)((pos) & (ring)->mask) * (ring)->stride))
+#define __RING_SEQ_SIZE         8   // Keeps the element 8-byte aligned
+
+nic_ring_t * nic_ring_create(unsigned int count, unsigned int elem_size) {
+    if (count == 0 || count > (1u << 30) || elem_size == 0) {
+        return NULL;
+    }
+    nic_ring_t *ring = NULL;
+    if (posix_memalign((void **)&ring, NIC_RING_CACHELINE, sizeof(nic_ring_t)) != 0) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(nic_ring_t));
+    ring->size = 1;
+    while (ring->size < count) {
+        ring->size <<= 1;
+    }
+    ring->mask = ring->size - 1;
+    ring->elem_size = elem_size;
+    ring->stride = (__RING_SEQ_SIZE + elem_size + 7) & ~7u;
+    if (posix_memalign((void **)&ring->slots, NIC_RING_CACHELINE, (size_t)ring->size * ring->stride) != 0) {
+        free(ring);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < ring->size; i++) {
+        *__RING_SLOT(ring, i) = i;
+    }
+    return ring;
+}
+
+void nic_ring_free(nic_ring_t *ring) {
+    if (ring) {
+        free(ring->slots);
+        free(ring);
+    }
+}
+
+int nic_ring_enqueue(nic_ring_t *ring, const void *elem) {
+    uint32_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t *slot;
+    for (;;) {
+        slot = __RING_SLOT(ring, pos);
+        int32_t diff = (int32_t)(__atomic_load_n(slot, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            // On failure pos is reloaded with the current tail
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Full, unless a nic_ring_dequeue_mc() caller claimed this slot a
+            // lap ago and has not released it yet: it will in a moment
+            if (pos - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= ring->size) {
+                return -1;
+            }
+            sched_yield();
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy((unsigned char *)slot + __RING_SEQ_SIZE, elem, ring->elem_size);
+    __atomic_store_n(slot, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int nic_ring_dequeue(nic_ring_t *ring, void *elem) {
+    return nic_ring_dequeue_burst(ring, elem, 1);
+}
+
+unsigned int nic_ring_dequeue_burst(nic_ring_t *ring, void *elems, unsigned int max) {
+    uint32_t pos = ring->head;
+    unsigned int count = 0;
+    // Stops at the first slot claimed but not published yet, keeping the order
+    while (count < max) {
+        uint32_t *slot = __RING_SLOT(ring, pos);
+        if (__atomic_load_n(slot, __ATOMIC_ACQUIRE) != pos + 1) {
+            break;
+        }
+        memcpy((unsigned char *)elems + (size_t)count * ring->elem_size, (unsigned char *)slot + __RING_SEQ_SIZE, ring->elem_size);
+        __atomic_store_n(slot, pos + ring->size, __ATOMIC_RELEASE);
+        pos++;
+        count++;
+    }
+    __atomic_store_n(&ring->head, pos, __ATOMIC_RELEASE);
+    return count;
+}
+
+int nic_ring_dequeue_mc(nic_ring_t *ring, void *elem) {
+    uint32_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t *slot;
+    for (;;) {
+        slot = __RING_SLOT(ring, pos);
+        int32_t diff = (int32_t)(__atomic_load_n(slot, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;   // Not published yet: empty
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(elem, (unsigned char *)slot + __RING_SEQ_SIZE, ring->elem_size);
+    __atomic_store_n(slot, pos + ring->size, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int nic_ring_empty(nic_ring_t *ring) {
+    uint32_t pos = ring->head;
+    return __atomic_load_n(__RING_SLOT(ring, pos), __ATOMIC_SEQ_CST) != pos + 1;
+}
+
+unsigned int nic_ring_count(nic_ring_t *ring) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return tail - head;
+}
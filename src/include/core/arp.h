@@ -8,22 +8,87 @@
 #define ARP_REQUEST 1
 #define ARP_REPLY   2
 #define ETH_P_ARP   0x0806
-#define ARP_TABLE_SIZE 8
+
+// Caché de vecinos: tabla hash de tamaño fijado al crearla, dividida en
+// ventanas de ARP_TABLE_WAYS entradas. Una IP solo puede estar en la ventana
+// que le toca por hash; si está llena se expulsa la entrada usada hace más
+// tiempo (LRU dentro de la ventana).
+#define ARP_TABLE_DEFAULT_SIZE  1024
+#define ARP_TABLE_WAYS          8
+
+// Edad de una entrada desde la última respuesta que la confirmó
+#define ARP_REACHABLE_MS        30000   // Hasta aquí REACHABLE
+#define ARP_EXPIRE_MS           300000  // Hasta aquí STALE (se sigue usando), luego EXPIRED
+
+// Paquetes a la espera de resolución: hasta ARP_PENDING_MAX vecinos a la
+// vez, con una cola de ARP_QUEUE_DEPTH paquetes cada uno. La petición se
+// repite cada ARP_RETRY_MS, como mucho ARP_MAX_RETRIES veces.
+#define ARP_PENDING_MAX         64
+#define ARP_QUEUE_DEPTH         16
+#define ARP_RETRY_MS            1000
+#define ARP_MAX_RETRIES         3
+#define ARP_TIMER_TICK_MS       100
+
+// Estados de una entrada
+#define ARP_STATE_FREE          0
+#define ARP_STATE_REACHABLE     1
+#define ARP_STATE_STALE         2
+#define ARP_STATE_EXPIRED       3
 
 // Funciones públicas
 void arp_send_request(nic_driver_t *drv,nic_device_t *device,uint32_t target_ip);
 void arp_send_reply(nic_driver_t *drv,nic_device_t *device,uint8_t *target_mac, uint32_t target_ip);
-void arp_rx(uint8_t *buf, unsigned int len);
+// Gratuitous ARP con la IP de la NIC, para que los vecinos nos conozcan
+// antes de nuestro primer envío (arp_init() ya lo manda)
+void arp_announce(nic_device_t *device);
+// Trama ARP completa recibida por nic: contesta los Request a nuestra IP y
+// aprende la MAC del emisor
+void arp_rx(nic_device_t *nic, const uint8_t *buf, unsigned int len);
+// Limpia la tabla (la crea con ARP_TABLE_DEFAULT_SIZE entradas si no existe),
+// arranca el temporizador de reintentos, registra ARP como manejador del
+// EtherType 0x0806 y se anuncia con un gratuitous ARP (tras init y con la IP ya puesta)
+int arp_init(nic_device_t *nic);
+// Para el temporizador y libera los paquetes pendientes (antes del shutdown de la NIC)
+void arp_shutdown(void);
+
+// MAC de ip (orden de host) para enviarle mbuf, un paquete IPv4 aún sin
+// cabecera Ethernet. Si está en la caché la copia en mac y devuelve 0. Si no,
+// ARP se queda con el mbuf hasta que llegue la respuesta (lo envía entonces
+// con offload, ya relativo a la trama Ethernet) y devuelve 1; con la cola del
+// vecino llena lo libera y devuelve -1.
+int arp_resolve(nic_device_t *nic, uint32_t ip, uint8_t *mac, nic_mbuf_t *mbuf, const hal_offload_t *offload);
 
+// Entrada protegida por un seqlock: el escritor deja seq impar mientras la
+// modifica y los lectores repiten la lectura si seq cambió por medio. Los
+// campos se leen y escriben con atómicos, la MAC empaquetada en 48 bits.
 typedef struct {
-    uint32_t ip;
-    uint8_t  mac[6];
-    int      valid;
+    uint32_t seq;
+    uint32_t ip;                // Orden de host
+    uint64_t mac;
+    uint64_t confirmed;         // ms (CLOCK_MONOTONIC) de la última confirmación
+    uint64_t used;              // ms del último uso, para el LRU
+    uint32_t generation;        // Cambia al entrar la IP o cambiar su MAC
+    int      in_use;
 } arp_entry_t;
 
+// (Re)crea la tabla vacía con entries entradas (redondeado a potencia de 2).
+// Solo antes de que haya tráfico. 0 si va bien, -1 si no hay memoria.
+int arp_table_init_size(unsigned int entries);
 void arp_table_init(void);
-void arp_table_add(uint32_t ip, uint8_t *mac);
-uint8_t *arp_table_lookup(uint32_t ip);
+// Inserta o actualiza la IP (orden de host): nunca duplica entradas. Envía
+// en el acto los paquetes que esperaban esa MAC.
+void arp_table_add(uint32_t ip, const uint8_t *mac);
+// Copia en mac la dirección de la IP si la entrada es REACHABLE o STALE.
+// 0 si la encuentra, -1 si no. Sin cerrojos: nunca espera a los escritores.
+int arp_table_lookup(uint32_t ip, uint8_t *mac);
+// ARP_STATE_* actual de la IP
+int arp_table_state(uint32_t ip);
+// Generación de la entrada de la IP (orden de host), 0 si no está. Cambia
+// cada vez que la IP entra o cambia de MAC, pero no con cada confirmación, y
+// dos entradas nunca comparten valor. Quien guarde MACs fuera de la tabla (la
+// caché de destinos de IPv4) la lee antes de consultar la MAC y la descarta
+// cuando cambia: un cambio en otro vecino no le afecta.
+uint32_t arp_table_generation(uint32_t ip);
 void arp_table_print(void);
 
 
@@ -0,0 +1,39 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Checksum de Internet (RFC 1071) compartido por IPv4, ICMP y TCP.
+//
+// Las sumas parciales (uint32_t) son sumas en complemento a uno sin plegar ni
+// negar, en el orden de bytes de la máquina como los campos de las cabeceras:
+// se pueden encadenar pasando el resultado de una como sum de la siguiente,
+// siempre que cada trozo empiece en un offset par del mensaje.
+
+// Implementaciones de csum_partial(); AUTO elige la mejor que tenga la CPU
+#define CSUM_IMPL_AUTO          0
+#define CSUM_IMPL_SCALAR        1
+#define CSUM_IMPL_SSE2          2
+#define CSUM_IMPL_AVX2          3
+
+// Suma data[0..len) a sum
+uint32_t csum_partial(const void *data, size_t len, uint32_t sum);
+// Igual, copiando a la vez src en dst (una sola pasada por memoria)
+uint32_t csum_partial_copy(void *dst, const void *src, size_t len, uint32_t sum);
+// Pliega una suma parcial a 16 bits y la niega: el valor del campo checksum
+uint16_t csum_fold(uint32_t sum);
+// Checksum de un buffer completo; 0 al verificar uno que incluye su checksum
+uint16_t csum(const void *data, size_t len);
+
+// Actualización incremental (RFC 1624, ec. 3) al reescribir un campo de una
+// cabecera ya sumada: check' = ~(~check + ~old + new). Todo en orden de red.
+uint16_t csum_update16(uint16_t check, uint16_t old_value, uint16_t new_value);
+uint16_t csum_update32(uint16_t check, uint32_t old_value, uint32_t new_value);
+
+// Fuerza una implementación (CSUM_IMPL_*). -1 si la CPU no la soporta
+int csum_select(unsigned int impl);
+// Nombre de la implementación en uso ("scalar", "sse2", "avx2")
+const char *csum_impl_name(void);
+
+#endif
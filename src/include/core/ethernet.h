@@ -2,6 +2,7 @@
 #define ETHERNET_H
 
 #include <stdint.h>
+#include "drivers/mbuf.h"
 
 // Tamaños básicos
 #define ETH_MAC_LEN     6
@@ -29,6 +30,12 @@ int eth_make_frame(uint8_t *buffer,
                    void *data,
                    int data_len);
 
+// Añadir la cabecera Ethernet en el headroom de un mbuf (0, o -1 sin espacio)
+int eth_push_header(nic_mbuf_t *mbuf,
+                    const uint8_t *dest_mac,
+                    const uint8_t *src_mac,
+                    uint16_t type);
+
 // Leer un frame Ethernet
 int eth_read_frame(uint8_t *buffer, 
                    int buffer_len,
@@ -17,6 +17,7 @@ typedef struct {
 } __attribute__((packed)) icmp_hdr_t;
 
 void icmp_receive(void *nic, uint32_t src_ip, const void *payload, uint16_t len);
+void icmp_init(void);
 void icmp_send(void *nic, uint32_t dst_ip, uint8_t type, uint8_t code, uint16_t id, uint16_t seq, const void *data, uint16_t data_len);
 
 #endif
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "drivers/hal.h"
+#include "drivers/mbuf.h"
 
 // Forward declaration para evitar errores de tipo
 struct nic_device; 
@@ -21,9 +23,33 @@ struct ipv4_header {
     uint32_t destination_address;
 } __attribute__((packed));
 
+// Caché de destinos de ipv4_send_mbuf(): cabeceras Ethernet + IPv4 ya montadas
+// por (NIC, IP destino, protocolo), en una tabla de correspondencia directa
+#define IPV4_DST_CACHE_SIZE         256     // Potencia de 2
+#define IPV4_DST_HDR_LEN            34      // ETH_HDR_LEN + cabecera IPv4
+#define IPV4_DST_HDR_WORDS          5       // IPV4_DST_HDR_LEN en palabras de 64 bits
+#define IPV4_DST_REVALIDATE_MS      1000    // Cada cuánto se vuelve a consultar ARP
+
+// Manejador de un protocolo de transporte: IP de origen (orden de red), payload IP
+// y los flags HAL_FRAME_* de la trama. Con HAL_FRAME_CSUM_VALID (comprobado por
+// el kernel o la NIC) o HAL_FRAME_CSUM_PARTIAL (trama local aún sin checksum)
+// el manejador no debe verificar el checksum en software.
+typedef void (*ipv4_protocol_handler_t)(nic_device_t *nic, uint32_t src_ip, const void *payload, uint16_t len,
+                                        unsigned int flags);
+
 // Prototipos
 uint16_t ipv4_checksum(void *vdata, size_t length);
 void ipv4_send(nic_device_t *nic, uint32_t dst_ip, uint8_t protocol, const void *data, uint16_t data_len);
+void ipv4_send_offload(nic_device_t *nic, uint32_t dst_ip, uint8_t protocol, const void *data, uint16_t data_len,
+                       const hal_offload_t *l4_offload);
+void ipv4_send_mbuf(nic_device_t *nic, uint32_t dst_ip, uint8_t protocol, nic_mbuf_t *mbuf,
+                    const hal_offload_t *l4_offload);
 void ipv4_receive(nic_device_t *nic, const void *packet, unsigned int len);
+// Igual, con los flags HAL_FRAME_* de la trama recibida
+void ipv4_receive_flags(nic_device_t *nic, const void *packet, unsigned int len, unsigned int flags);
+// Registra IPv4 como manejador del EtherType 0x0800 de la NIC (tras init)
+int ipv4_init(nic_device_t *nic);
+// Asocia un protocolo (1 = ICMP, 6 = TCP...) a su manejador, NULL lo quita
+void ipv4_register_protocol_handler(uint8_t protocol, ipv4_protocol_handler_t handler);
 
 #endif
\ No newline at end of file
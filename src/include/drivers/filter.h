@@ -0,0 +1,25 @@
+#ifndef _FILTER_H
+#define _FILTER_H
+
+#include <stdint.h>
+#include "drivers/hal.h"
+
+#define NIC_FILTER_MAX_PORTS            32
+#define NIC_FILTER_MAX_INSNS            (32 + NIC_FILTER_MAX_PORTS)
+
+// What the stack consumes, turned into a classic BPF program by nic_filter_build()
+typedef struct nic_filter {
+    int enabled;
+    unsigned char mac[6];
+    int promiscuous;                        // Skip the destination MAC check
+    uint32_t ip_address;                    // Network order, 0 = any
+    uint16_t tcp_ports[NIC_FILTER_MAX_PORTS];   // Host order, listening ports
+    unsigned int port_count;
+} nic_filter_t;
+
+// Accepts frames to our MAC or broadcast carrying ARP, or IPv4 to our address
+// (or limited broadcast) that is ICMP or TCP towards one of the ports.
+// Returns the number of instructions written to prog, 0 on error.
+unsigned int nic_filter_build(const nic_filter_t *filter, hal_filter_insn_t *prog, unsigned int max_insns);
+
+#endif
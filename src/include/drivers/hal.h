@@ -1,13 +1,206 @@
 #ifndef _HAL_H
-#define _HAL_H 
+#define _HAL_H
+
+#include <stdint.h>
 
-#define HAL_IFACE_NAME "eth0"
 #define HAL_IFACE_NAMELEN 32
 
-void * hal_create_device();
+// Backends
+#define HAL_BACKEND_PACKET              0   // AF_PACKET raw socket (default)
+#define HAL_BACKEND_XDP                 1   // AF_XDP socket, see hal_xdp.c
+#define HAL_BACKEND_LOOP                2   // In-process pair of devices, see hal_loop.c
+#define HAL_BACKEND_TAP                 3   // /dev/net/tun TAP with virtio-net header, see hal_tap.c
+#define HAL_BACKEND_COUNT               4
+
+// TX offloads, see hal_send_offload()
+#define HAL_OFFLOAD_CSUM                0x01    // Partial L4 checksum finished by the backend
+#define HAL_OFFLOAD_TSO4                0x02    // TCP/IPv4 super-frame segmented by the backend
+// RX metadata, hal_frame_t.flags
+#define HAL_FRAME_CSUM_VALID            0x01    // Checksums already verified by the kernel or the NIC
+#define HAL_FRAME_CSUM_PARTIAL          0x02    // Locally sent frame, L4 checksum not filled in yet
+#define HAL_FRAME_VLAN                  0x04    // Tag stripped by the NIC, see vlan_tci / vlan_tpid
+#define HAL_FRAME_TRUNCATED             0x08    // Cut to the caller's buffer by nic_receive_batch()
+#define HAL_GSO_MAX_SIZE                (14 + 65535)    // Largest frame with HAL_OFFLOAD_TSO4: Ethernet + max IPv4 packet
+
+// RX modes
+#define HAL_RX_MODE_READ                0   // One read() syscall per frame
+#define HAL_RX_MODE_RING                1   // PACKET_MMAP TPACKET_V3 block ring
+
+// TX modes
+#define HAL_TX_MODE_WRITE               0   // One write() syscall per frame
+#define HAL_TX_MODE_RING                1   // PACKET_TX_RING slots flushed with one send() kick
+
+// Multi-queue RX: sockets spread over a PACKET_FANOUT group
+#define HAL_FANOUT_NONE                 0
+#define HAL_FANOUT_HASH                 1   // By flow hash, like RSS
+#define HAL_FANOUT_CPU                  2   // By the CPU the frame arrived on
+
+// Default geometry of the TPACKET_V3 RX ring
+#define HAL_RX_RING_BLOCK_SIZE          (1 << 18)   // 256 KiB per block
+#define HAL_RX_RING_BLOCK_COUNT         64
+#define HAL_RX_RING_FRAME_SIZE          2048
+#define HAL_RX_RING_BLOCK_TIMEOUT_MS    1           // Retire partially filled blocks after 1ms
+#define HAL_POLL_TIMEOUT_MS             1
+#define HAL_BATCH_MAX                   256         // Max frames per recvmmsg()/sendmmsg()
+
+// Default geometry of the TX ring
+#define HAL_TX_RING_FRAME_SIZE          2048
+#define HAL_TX_RING_FRAME_COUNT         1024
+
+// Default loopback geometry, sizes are powers of two
+#define HAL_LOOP_SLOT_SIZE              2048
+#define HAL_LOOP_SLOT_COUNT             1024
+#define HAL_LOOP_MTU                    1500
+
+// Default AF_XDP geometry, sizes are powers of two
+#define HAL_XDP_FRAME_SIZE              2048
+#define HAL_XDP_FRAME_COUNT             4096        // Half for RX (fill ring), half for TX
+#define HAL_XDP_RING_SIZE               2048
+
+struct hal_ops;
+
+// Per-frame TX offload request. Offsets are from the start of the frame.
+// With HAL_OFFLOAD_CSUM the checksum field at csum_start + csum_offset holds
+// the folded pseudo-header sum and the backend completes it over
+// [csum_start, end). With HAL_OFFLOAD_TSO4 the frame is cut into segments of
+// gso_size payload bytes, each carrying a copy of the first hdr_len bytes.
+typedef struct hal_offload {
+    unsigned int flags;                     // HAL_OFFLOAD_*
+    unsigned short csum_start;
+    unsigned short csum_offset;
+    unsigned short hdr_len;
+    unsigned short gso_size;
+} hal_offload_t;
+
+typedef struct hal_config {
+    unsigned int backend;                   // HAL_BACKEND_*
+    const struct hal_ops *ops;              // When set, overrides backend
+    char ifname[HAL_IFACE_NAMELEN];         // Interface, or link name for HAL_BACKEND_LOOP
+
+    unsigned int rx_mode;
+    // Ring geometry, 0 selects the defaults above
+    unsigned int rx_block_size;
+    unsigned int rx_block_count;
+    unsigned int rx_frame_size;
+
+    unsigned int tx_mode;
+    unsigned int tx_frame_size;
+    unsigned int tx_frame_count;
+    int tx_qdisc_bypass;                    // Skip the kernel qdisc layer (PACKET_QDISC_BYPASS)
+
+    // AF_PACKET only: join fanout_group (16 bits) with this HAL_FANOUT_* mode
+    unsigned int fanout_mode;
+    unsigned int fanout_group;
+
+    // AF_XDP only, 0 selects the defaults above
+    unsigned int xdp_queue_id;
+    // Hardware queues [0, xdp_queue_count) the interface's shared XSKMAP can
+    // redirect, fixed by the first queue opened (0 = xdp_queue_id + 1)
+    unsigned int xdp_queue_count;
+    unsigned int xdp_frame_count;
+    unsigned int xdp_ring_size;
+} hal_config_t;
+
+// Classic BPF instruction, same layout as struct sock_filter
+typedef struct hal_filter_insn {
+    uint16_t code;
+    uint8_t jt;
+    uint8_t jf;
+    uint32_t k;
+} hal_filter_insn_t;
+
+// Frame descriptor. On the zero-copy RX path data points into the ring and
+// stays valid until the next call to hal_release_zc(). For hal_receive_batch()
+// the caller provides data and sets length to the buffer size. On RX,
+// timestamp is the kernel's receive time in CLOCK_REALTIME nanoseconds when
+// the backend has one (TPACKET_V3 ring), otherwise it is left at 0. flags
+// (HAL_FRAME_*) carries what the kernel knows about the frame: TP_STATUS_* of
+// the ring or of PACKET_AUXDATA, the virtio header on TAP, 0 elsewhere.
+typedef struct hal_frame {
+    void *data;
+    unsigned int length;
+    uint64_t timestamp;
+    unsigned int flags;
+    uint16_t vlan_tci;              // HAL_FRAME_VLAN only
+    uint16_t vlan_tpid;
+} hal_frame_t;
+
+// Backend table. Every handle returned by create_device starts with a
+// hal_handle_t so hal.c can dispatch on it. Members other than create_device,
+// remove_device, get_mac_address and get_mtu may be NULL: hal.c then falls
+// back on the ones that are present (e.g. send_batch on top of tx_acquire/
+// tx_commit/tx_kick, receive on top of receive_zc).
+typedef struct hal_ops {
+    const char *name;
+    void * (*create_device)(const hal_config_t *config);
+    void (*remove_device)(void *handle);
+    unsigned int (*send)(void *handle, void *data, unsigned int length);
+    unsigned int (*receive)(void *handle, void *buffer, unsigned int buffer_length);
+    unsigned int (*send_batch)(void *handle, hal_frame_t *frames, unsigned int count);
+    unsigned int (*receive_batch)(void *handle, hal_frame_t *frames, unsigned int count);
+    int (*wait)(void *handle, int timeout_ms);
+    int (*is_zero_copy)(void *handle);
+    unsigned int (*receive_zc)(void *handle, hal_frame_t *frames, unsigned int max_frames);
+    void (*release_zc)(void *handle);
+    int (*has_tx_ring)(void *handle);
+    void * (*tx_acquire)(void *handle, unsigned int *capacity);
+    void (*tx_commit)(void *handle, unsigned int length);
+    int (*tx_kick)(void *handle, unsigned int *failed);
+    int (*set_qdisc_bypass)(void *handle, int enable);
+    void (*get_mac_address)(void *handle, unsigned char *mac);
+    unsigned int (*get_mtu)(void *handle);
+    unsigned int (*get_offloads)(void *handle);
+    unsigned int (*send_offload)(void *handle, void *data, unsigned int length, const hal_offload_t *offload);
+    int (*set_filter)(void *handle, const hal_filter_insn_t *prog, unsigned int length);
+    // Event-driven waiting, see hal_get_fd()
+    int (*get_fd)(void *handle);
+    int (*prepare_wait)(void *handle);
+    void (*finish_wait)(void *handle);
+    unsigned int (*tx_inflight)(void *handle);
+    int (*set_busy_poll)(void *handle, int usecs);
+} hal_ops_t;
+
+typedef struct hal_handle {
+    const hal_ops_t *ops;
+} hal_handle_t;
+
+extern const hal_ops_t hal_packet_ops;
+extern const hal_ops_t hal_xdp_ops;
+extern const hal_ops_t hal_loop_ops;
+extern const hal_ops_t hal_tap_ops;
+
+const hal_ops_t * hal_get_backend(unsigned int backend);
+void * hal_create_device(const hal_config_t *config);
 void hal_remove_device(void *handle);
 unsigned int hal_send(void * handle, void * data, unsigned int length);
 unsigned int hal_receive(void * handle, void * buffer, unsigned int buffer_length);
+unsigned int hal_receive_batch(void * handle, hal_frame_t *frames, unsigned int count);
+unsigned int hal_send_batch(void * handle, hal_frame_t *frames, unsigned int count);
+int hal_wait(void * handle, int timeout_ms);
+unsigned int hal_receive_zc(void * handle, hal_frame_t *frames, unsigned int max_frames);
+void hal_release_zc(void * handle);
+int hal_is_zero_copy(void * handle);
+void * hal_tx_acquire(void * handle, unsigned int *capacity);
+void hal_tx_commit(void * handle, unsigned int length);
+int hal_tx_kick(void * handle, unsigned int *failed);
+int hal_has_tx_ring(void * handle);
+int hal_set_qdisc_bypass(void * handle, int enable);
 void hal_get_mac_address(void * handle, unsigned char *mac);
 unsigned int hal_get_mtu(void * handle);
-#endif
\ No newline at end of file
+unsigned int hal_get_offloads(void * handle);
+unsigned int hal_send_offload(void * handle, void * data, unsigned int length, const hal_offload_t *offload);
+// Attach a kernel-side filter to the device (length 0 detaches it), -1 if unsupported
+int hal_set_filter(void * handle, const hal_filter_insn_t *prog, unsigned int length);
+// File descriptor that turns readable when frames arrive, for the caller's own
+// epoll set (-1 if the backend has none, use hal_wait() then). Sleeping on it
+// goes between hal_prepare_wait(), which returns non-zero when frames are
+// already there and the caller must not sleep, and hal_finish_wait().
+int hal_get_fd(void * handle);
+int hal_prepare_wait(void * handle);
+void hal_finish_wait(void * handle);
+// Frames handed to the TX ring that the backend has not completed yet; while
+// non-zero the caller has to come back and kick instead of sleeping for long
+unsigned int hal_tx_inflight(void * handle);
+// SO_BUSY_POLL on the underlying socket (0 turns it off), -1 if unsupported
+int hal_set_busy_poll(void * handle, int usecs);
+#endif
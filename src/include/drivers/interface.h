@@ -4,14 +4,59 @@
 #include <stdint.h>
 #include <pthread.h>
 #include "drivers/hal.h"
+#include "drivers/filter.h"
+#include "drivers/ring.h"
+#include "drivers/mbuf.h"
 
 #define NIC_DEFAULT_MTU                 1500
 #define NIC_EXTRA_SIZE                  18  // Ethernet header + CRC 
 #define NIC_DEFAULT_MAC                 {0x00, 0x1A, 0x2B, 0x3C, 0x4D, 0x5E}
+#define NIC_RX_BURST                    256 // Max frames taken from the HAL per loop iteration
+#define NIC_TX_BURST                    256 // Max frames handed to the HAL per loop iteration
+#define NIC_MAX_QUEUES                  64  // Max RX queues (fanout sockets), one worker thread each
+#define NIC_TX_RING_SIZE                4096 // Default depth of the TX descriptor ring
+#define NIC_RX_RING_SIZE                1024 // Default depth of the nic_receive_packet() FIFO
+#define NIC_IDLE_TIMEOUT_MS             100 // Longest epoll sleep of an idle worker
+#define NIC_DEFAULT_SPIN_USECS          50  // NIC_POLL_MODE_ADAPTIVE spin before sleeping
+
+// Worker poll modes, see NIC_IOCTL_SET_POLL_MODE
+#define NIC_POLL_MODE_EVENT             0   // Sleep in epoll as soon as there is nothing to do (default)
+#define NIC_POLL_MODE_BUSY              1   // Never sleep, every worker keeps its core at 100%
+#define NIC_POLL_MODE_ADAPTIVE          2   // Spin for spin_usecs after the last frame, then sleep
+
+// What a full RX FIFO does with a new frame, see NIC_IOCTL_SET_RX_DROP_POLICY
+#define NIC_RX_DROP_TAIL                0   // Drop the new frame (default)
+#define NIC_RX_DROP_HEAD                1   // Drop the oldest queued frame to make room
+
+// Why a frame was dropped, index of nic_stats_t.drops
+#define NIC_DROP_RX_FIFO_FULL           0   // nic_receive_packet() FIFO full, see NIC_IOCTL_SET_RX_DROP_POLICY
+#define NIC_DROP_RX_NO_MBUF             1   // Pool empty when copying a frame into the FIFO
+#define NIC_DROP_TX_RING_FULL           2   // TX ring full or at its limit, see NIC_IOCTL_SET_TX_LIMITS
+#define NIC_DROP_TX_NO_MBUF             3   // Pool empty in nic_send_packet()
+#define NIC_DROP_TX_INVALID             4   // Refused by the length/offload checks
+#define NIC_DROP_RX_TRUNCATED           5   // Longer than the buffer given to nic_receive_batch(), tail lost
+#define NIC_DROP_REASONS                6
+
+// Received EtherTypes counted apart, index of nic_stats_t.rx_ethertype
+#define NIC_STATS_ETH_IPV4              0
+#define NIC_STATS_ETH_ARP               1
+#define NIC_STATS_ETH_IPV6              2
+#define NIC_STATS_ETH_VLAN              3   // 802.1Q and 802.1ad tags
+#define NIC_STATS_ETH_OTHER             4
+#define NIC_STATS_ETH_CLASSES           5
+
+// Frame size histogram: <64, 64, 65-127, 128-255, 256-511, 512-1023,
+// 1024-1518 and larger (jumbo and TSO super-frames)
+#define NIC_STATS_SIZE_BUCKETS          8
+#define NIC_STATS_SHARDS                16  // Drop counter shards for sending threads
 
 // Ethertype values
 #define ETH_P_IP                        0x0800
 
+// EtherType demux table: the high byte selects a page of 256 handlers,
+// allocated on first registration, the low byte indexes into it
+#define NIC_ETHERTYPE_PAGES             256
+
 #define NIC_IOCTL_CHANGE_MAC            0x01
 #define NIC_IOCTL_SET_MTU               0x02
 #define NIC_IOCTL_GET_STATS             0x03
@@ -25,37 +70,150 @@
 #define NIC_IOCTL_SET_PROMISCUOUS_MODE  0x0B
 #define NIC_IOCTL_UP                    0x0C
 #define NIC_IOCTL_DOWN                  0x0D
+#define NIC_IOCTL_SET_QDISC_BYPASS      0x0E
+#define NIC_IOCTL_GET_OFFLOADS          0x0F
+#define NIC_IOCTL_GET_QUEUE_STATS       0x10
+#define NIC_IOCTL_SET_FILTER            0x11    // int *: attach/detach the kernel-side BPF filter
+#define NIC_IOCTL_ADD_FILTER_PORT       0x12    // uint16_t *: TCP port (host order) to let through
+#define NIC_IOCTL_REMOVE_FILTER_PORT    0x13    // uint16_t *
+#define NIC_IOCTL_SET_IP_ADDRESS        0x14    // uint32_t *: network order
+#define NIC_IOCTL_SET_POLL_MODE         0x15    // nic_poll_config_t *
+#define NIC_IOCTL_ADD_RX_BURST_CALLBACK 0x16    // nic_burst_callback_t
+#define NIC_IOCTL_REMOVE_RX_BURST_CALLBACK 0x17
+#define NIC_IOCTL_SET_RX_DROP_POLICY    0x18    // unsigned int *: NIC_RX_DROP_*
+#define NIC_IOCTL_SET_THREAD_AFFINITY   0x19    // nic_thread_config_t *: thread, cpu
+#define NIC_IOCTL_SET_THREAD_SCHED      0x1A    // nic_thread_config_t *: thread, policy, priority
+#define NIC_IOCTL_SET_TX_LIMITS         0x1B    // nic_tx_limits_t *
+#define NIC_IOCTL_ADD_TX_WATERMARK_CALLBACK 0x1C    // nic_watermark_callback_t
+#define NIC_IOCTL_REMOVE_TX_WATERMARK_CALLBACK 0x1D
+
+// nic_thread_config_t.thread naming the TX thread, RX workers go by queue index
+#define NIC_THREAD_TX                   -1
 
 typedef enum {
     STATUS_OK = 0,
     STATUS_ERROR = -1,
     STATUS_NOT_SUPPORTED = -2,
     STATUS_INVALID_PARAM = -3,
+    STATUS_BUSY = -4,           // TX queue at its limit: frame dropped, slow down until it drains
     // Additional status codes can be added here
 } status_t;
 
 typedef void (*nic_event_callback_t)(const void *data, unsigned int length);
+// Called once per received burst with every frame of it (data, length and
+// receive timestamp). The frames are only valid during the call.
+typedef void (*nic_burst_callback_t)(const hal_frame_t *frames, unsigned int count);
+// Called from the TX thread when the TX queue reaches the high watermark
+// (congested = 1, producers should pause) and again when it has drained down
+// to the low watermark (congested = 0). queued is the depth seen at that time.
+typedef void (*nic_watermark_callback_t)(unsigned int queued, int congested);
 
-typedef struct nic_callback {
-    nic_event_callback_t callback;
-    struct nic_callback *next;
-} nic_callback_t;
+struct nic_device;
 
+// Protocol handler for one EtherType, see nic_register_ethertype_handler().
+// Gets the whole frame, Ethernet header included, and its RX metadata
+// (HAL_FRAME_* flags, VLAN tag), valid only during the call.
+typedef void (*nic_ethertype_handler_t)(struct nic_device *device, const hal_frame_t *frame);
+
+// Immutable snapshot of a callback list, called in registration order. The
+// NIC threads walk it without locking; adding or removing a callback publishes
+// a new snapshot and retires this one until no thread can still be using it.
+typedef struct nic_callback_set {
+    struct nic_callback_set *retired_next;  // Retired list, see nic_device_t
+    uint64_t retire_epoch;
+    unsigned int count;
+    nic_event_callback_t callbacks[];
+} nic_callback_set_t;
+
+// Only unsigned long counters: shards are added up field by field. Each queue
+// owns one shard, written by its worker alone, NIC_IOCTL_GET_STATS sums them.
 typedef struct nic_stats {
     unsigned long tx_packets;
     unsigned long rx_packets;
     unsigned long tx_errors;
     unsigned long rx_errors;
     unsigned long collisions;
+    unsigned long rx_bytes;
+    unsigned long tx_bytes;         // Frames handed to the HAL, failed ones included
+    unsigned long drops[NIC_DROP_REASONS];
+    unsigned long rx_ethertype[NIC_STATS_ETH_CLASSES];
+    unsigned long rx_ip_protocol[256];  // IPv4 frames by protocol field
+    unsigned long rx_size_hist[NIC_STATS_SIZE_BUCKETS];
+    unsigned long tx_size_hist[NIC_STATS_SIZE_BUCKETS];
+    unsigned long tx_pauses;        // TX queue high watermark crossings
+    // Sums of drops[], filled in on read
+    unsigned long rx_dropped;
+    // Device-wide, only filled in by NIC_IOCTL_GET_STATS
+    unsigned long tx_queue_depth;   // Frames waiting in the TX ring
+    unsigned long tx_dropped;
+    unsigned long mbuf_in_use;      // Packet buffers taken from the pool
+    unsigned long mbuf_count;       // Pool size
+    unsigned long rx_queue_depth;   // Frames waiting for nic_receive_packet()
     // Additional statistics fields can be added here
 } nic_stats_t;
 
+// Drops counted by the threads calling nic_send_packet(), each thread
+// hashed to one shard, one cache line apart from the others
+typedef struct nic_stats_shard {
+    unsigned long drops[NIC_DROP_REASONS];
+} __attribute__((aligned(64))) nic_stats_shard_t;
+
+// Argument of NIC_IOCTL_GET_QUEUE_STATS: set queue, get its stats back
+typedef struct nic_queue_stats {
+    unsigned int queue;
+    nic_stats_t stats;
+} nic_queue_stats_t;
+
+// Argument of NIC_IOCTL_SET_POLL_MODE, may also be filled in before init
+typedef struct nic_poll_config {
+    unsigned int mode;          // NIC_POLL_MODE_*
+    unsigned int spin_usecs;    // NIC_POLL_MODE_ADAPTIVE only, 0 = NIC_DEFAULT_SPIN_USECS
+    int busy_poll_usecs;        // SO_BUSY_POLL on the sockets, 0 = off
+} nic_poll_config_t;
+
+// Argument of NIC_IOCTL_SET_THREAD_AFFINITY / NIC_IOCTL_SET_THREAD_SCHED. Applied
+// at once and kept for the threads started by a later NIC_IOCTL_UP.
+typedef struct nic_thread_config {
+    int thread;                 // RX queue index or NIC_THREAD_TX
+    int cpu;                    // Core to pin the thread to, -1 = any
+    int policy;                 // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+    int priority;               // sched_priority, FIFO/RR only
+} nic_thread_config_t;
+
+// Argument of NIC_IOCTL_SET_TX_LIMITS, may also be filled in before init. Zero
+// fields take the defaults: the ring capacity, 3/4 and 1/4 of the limit.
+typedef struct nic_tx_limits {
+    unsigned int limit;         // Most frames queued, past it sending returns STATUS_BUSY
+    unsigned int high_watermark;
+    unsigned int low_watermark; // Below high_watermark
+} nic_tx_limits_t;
+
+// TX descriptor: the frame and what the hardware should do with it
 typedef struct nic_buffer {
-    void *data;
-    unsigned int length;
-    struct nic_buffer *next;
+    nic_mbuf_t *mbuf;
+    hal_offload_t offload;      // flags == 0 for plain frames
 } nic_buffer_t;
 
+// One RX queue: a HAL handle (a socket of the fanout group) served by its own
+// worker thread. An idle worker sleeps in epoll on the HAL fd and on wake_fd,
+// the doorbell rung by shutdown and mode changes, but only while sleeping is
+// set. The TX thread uses the same structure on queue 0's handle, with only
+// the doorbell (rung by nic_send_packet()) to sleep on.
+typedef struct nic_queue {
+    struct nic_device *device;
+    unsigned int id;
+    void *hw_handle;
+    pthread_t thread;
+    int cpu;                    // Core the worker is pinned to, -1 = not pinned
+    int sched_policy;           // SCHED_OTHER unless set with NIC_IOCTL_SET_THREAD_SCHED
+    int sched_priority;
+    int epoll_fd;
+    int wake_fd;                // eventfd
+    int sleeping;
+    uint64_t rcu_epoch;         // Callback epoch seen at the last quiescent state, 0 = asleep
+    nic_stats_t stats __attribute__((aligned(64)));    // Written by the worker only
+} nic_queue_t;
+
 typedef struct nic_device {
     char name[32];
     unsigned char mac_address[6];
@@ -63,24 +221,78 @@ typedef struct nic_device {
     unsigned int mtu;
     unsigned short promiscuous_mode;
 
-    // Callback lists triggered on events
-    nic_callback_t *rx_callbacks;
-    nic_callback_t *tx_callbacks;
-    nic_callback_t *error_callbacks;
+    // Callback lists triggered on events, NULL when empty. Writers serialize
+    // on callback_lock and bump rcu_epoch for every snapshot they retire; a
+    // retired snapshot is freed once each awake NIC thread has seen that epoch.
+    nic_callback_set_t *rx_callbacks;
+    nic_callback_set_t *rx_burst_callbacks; // Entries hold a nic_burst_callback_t
+    nic_callback_set_t *tx_callbacks;
+    nic_callback_set_t *error_callbacks;
+    nic_callback_set_t *tx_watermark_callbacks; // Entries hold a nic_watermark_callback_t
+    nic_callback_set_t *retired_callbacks;
+    pthread_mutex_t callback_lock;
+    uint64_t rcu_epoch;
 
-    // Statistics
-    nic_stats_t stats;
+    // Received frames go to the handler of their EtherType, a two-level
+    // direct-indexed table (NIC_ETHERTYPE_PAGES pages of 256 entries).
+    // Frames of a type without handler go to the RX callbacks instead.
+    nic_ethertype_handler_t *ethertypes[NIC_ETHERTYPE_PAGES];
+
+    // Packet buffers for RX copies, TX frames and the upper layers. Set
+    // pool_size (0 = NIC_MBUF_POOL_SIZE) and pool_flags (NIC_MBUF_F_*) before init.
+    nic_mbuf_pool_t *pool;
+    unsigned int pool_size;
+    unsigned int pool_flags;
+
+    // Frames kept for nic_receive_packet(), shared by all the queues: a FIFO
+    // of rx_ring_size entries (0 = NIC_RX_RING_SIZE, set before init) under
+    // rx_lock. rx_drop_policy (NIC_RX_DROP_*) decides what goes when it is full.
+    nic_mbuf_t **rx_ring;
+    unsigned int rx_ring_size;
+    unsigned int rx_head;
+    unsigned int rx_count;
+    unsigned int rx_drop_policy;
+    pthread_mutex_t rx_lock;
+    pthread_cond_t rx_cond;         // Signalled when frames arrive and a reader waits
+    unsigned int rx_waiters;
 
-    // Internal buffers for rx and tx
-    nic_buffer_t *rx_buffer;
-    nic_buffer_t *tx_buffer;
+    // TX descriptors (nic_buffer_t): any thread enqueues, the TX thread
+    // drains. Set tx_ring_size before init, 0 = NIC_TX_RING_SIZE. tx_limits
+    // bounds the queue below the ring size: senders reserve a place in
+    // tx_queued before enqueueing and the TX thread gives it back on dequeue.
+    // tx_congested is the watermark state, owned by the TX thread.
+    nic_ring_t *tx_ring;
+    unsigned int tx_ring_size;
+    nic_tx_limits_t tx_limits;
+    unsigned int tx_queued;
+    int tx_congested;
+    nic_stats_shard_t stats_shards[NIC_STATS_SHARDS];
 
-    // Internal hardware device handle
+    // Internal hardware device handle (queue 0) and the configuration used to create it.
+    // hal_config may be filled in by the caller before init (zero = defaults).
     void *hw_handle;
+    hal_config_t hal_config;
 
-    // Internal status and thread
+    // Multi-queue RX, set queue_count before init (0 or 1 = single queue).
+    // The queues join one PACKET_FANOUT group (hal_config.fanout_mode, hash by
+    // default) and worker i is pinned to core i. Statistics live per queue.
+    unsigned int queue_count;
+    nic_queue_t queues[NIC_MAX_QUEUES];
+
+    // TX thread: drains tx_ring into queue 0's handle and fires the TX
+    // callbacks, so slow RX callbacks never hold transmission up
+    nic_queue_t tx_queue;
+
+    // Kernel-side filter built from mac_address, ip_address and the listening
+    // TCP ports, regenerated whenever one of them changes through nic_ioctl()
+    nic_filter_t filter;
+    pthread_mutex_t filter_lock;
+
+    // How idle workers wait for work, event-driven by default
+    nic_poll_config_t poll;
+
+    // Internal status
     int is_up;
-    pthread_t thread;
 
     // Additional device-specific fields can be added here
     // ...
@@ -92,7 +304,27 @@ typedef struct nic_driver {
     status_t (*send_packet)(nic_device_t *device, const void *data, unsigned int length);
     status_t (*receive_packet)(nic_device_t *device, void *buffer, unsigned int buffer_length);
     status_t (*ioctl)(nic_device_t *device, unsigned int command, void *arg);
+    // Like send_packet, with checksum/segmentation work left to the hardware
+    // (only the HAL_OFFLOAD_* bits reported by NIC_IOCTL_GET_OFFLOADS)
+    status_t (*send_packet_offload)(nic_device_t *device, const void *data, unsigned int length, const hal_offload_t *offload);
+    // Zero-copy TX: the frame was built in place in an mbuf from device->pool
+    // (headers pushed into its headroom) and is queued by reference. The
+    // driver takes the caller's reference, also when it returns an error.
+    status_t (*send_mbuf)(nic_device_t *device, nic_mbuf_t *mbuf, const hal_offload_t *offload);
+    // Like receive_packet, waiting up to timeout_ms (-1 = forever) for a frame.
+    // Readers must have returned before shutdown.
+    status_t (*receive_packet_timeout)(nic_device_t *device, void *buffer, unsigned int buffer_length, int timeout_ms);
+    // Takes up to count frames at once, waiting up to timeout_ms for the first.
+    // Each frames[i] brings its buffer and capacity and gets the frame length
+    // back, with its timestamp and HAL_FRAME_* metadata. A frame longer than
+    // the capacity is cut to it and flagged HAL_FRAME_TRUNCATED (counted in
+    // drops[NIC_DROP_RX_TRUNCATED]). Returns how many were filled in.
+    int (*receive_batch)(nic_device_t *device, hal_frame_t *frames, unsigned int count, int timeout_ms);
 } nic_driver_t;
 
 nic_driver_t * nic_get_driver();
+
+// Sets the handler of an EtherType (host order) on an initialized device,
+// NULL removes it. Replaces any previous handler of the same type.
+status_t nic_register_ethertype_handler(nic_device_t *device, uint16_t ethertype, nic_ethertype_handler_t handler);
 #endif
\ No newline at end of file
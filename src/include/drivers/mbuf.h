@@ -0,0 +1,71 @@
+#ifndef _MBUF_H
+#define _MBUF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "drivers/ring.h"
+
+#define NIC_MBUF_HEADROOM               128     // Room kept in front of the data for headers
+#define NIC_MBUF_DATA_ROOM              2048    // Largest frame a pool buffer holds
+#define NIC_MBUF_POOL_SIZE              8192    // Default number of buffers per pool
+
+// Pool flags
+#define NIC_MBUF_F_HUGEPAGE             0x01    // Back the pool with MAP_HUGETLB pages if the system has them
+
+// Packet buffer. The header and its storage come out of one preallocated
+// pool, so neither the RX nor the TX path calls malloc. Data starts at
+// data_off, after the headroom, and lower layers prepend their headers in
+// place. Frames larger than the pool's data room get a standalone buffer
+// (pool == NULL) that is malloc'd and freed as a whole.
+typedef struct nic_mbuf {
+    struct nic_mbuf_pool *pool;
+    struct nic_mbuf *next;          // Chains buffers in software queues
+    uint32_t refcnt;
+    uint32_t buf_len;               // Headroom + data room
+    uint32_t data_off;
+    uint32_t length;
+    // RX metadata of the frame (see hal_frame_t), zero on TX
+    uint64_t timestamp;
+    uint32_t flags;                 // HAL_FRAME_*
+    uint16_t vlan_tci;
+    uint16_t vlan_tpid;
+    unsigned char buf[] __attribute__((aligned(64)));
+} nic_mbuf_t;
+
+typedef struct nic_mbuf_pool {
+    nic_ring_t *free;               // nic_mbuf_t * of the buffers not in use
+    unsigned char *memory;
+    size_t memory_size;
+    unsigned int count;
+    unsigned int stride;
+    unsigned int data_room;
+    int hugepage;                   // Whether MAP_HUGETLB worked
+} nic_mbuf_pool_t;
+
+// data_room 0 = NIC_MBUF_DATA_ROOM. NULL on failure.
+nic_mbuf_pool_t * nic_mbuf_pool_create(unsigned int count, unsigned int data_room, unsigned int flags);
+void nic_mbuf_pool_free(nic_mbuf_pool_t *pool);
+unsigned int nic_mbuf_pool_in_use(nic_mbuf_pool_t *pool);
+
+// A buffer holding length bytes at NIC_MBUF_HEADROOM with refcnt 1, NULL when
+// the pool is exhausted. Any thread.
+nic_mbuf_t * nic_mbuf_alloc(nic_mbuf_pool_t *pool, unsigned int length);
+void nic_mbuf_ref(nic_mbuf_t *mbuf);
+// Drops a reference, the buffer goes back to its pool with the last one
+void nic_mbuf_free(nic_mbuf_t *mbuf);
+
+static inline void * nic_mbuf_data(nic_mbuf_t *mbuf) {
+    return mbuf->buf + mbuf->data_off;
+}
+
+// Grow the data by len bytes at the front, NULL when the headroom is short
+static inline void * nic_mbuf_prepend(nic_mbuf_t *mbuf, unsigned int len) {
+    if (len > mbuf->data_off) {
+        return NULL;
+    }
+    mbuf->data_off -= len;
+    mbuf->length += len;
+    return mbuf->buf + mbuf->data_off;
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include <stdint.h>
+
+#define NIC_RING_CACHELINE              64
+
+// Bounded lock-free multi-producer/single-consumer ring of fixed-size
+// elements, copied in and out by value. Producers claim a slot with a CAS on
+// tail and publish it through the slot's sequence number, so enqueue is O(1)
+// and never blocks; the consumer owns head and needs no atomic RMW at all.
+// Rings with several consumers use nic_ring_dequeue_mc() only.
+typedef struct nic_ring {
+    uint32_t tail __attribute__((aligned(NIC_RING_CACHELINE)));    // Next slot to claim, producers
+    uint32_t head __attribute__((aligned(NIC_RING_CACHELINE)));    // Next slot to read, consumer
+    uint32_t size __attribute__((aligned(NIC_RING_CACHELINE)));
+    uint32_t mask;
+    unsigned int elem_size;
+    unsigned int stride;
+    unsigned char *slots;
+} nic_ring_t;
+
+// count is rounded up to a power of two. NULL on allocation failure.
+nic_ring_t * nic_ring_create(unsigned int count, unsigned int elem_size);
+void nic_ring_free(nic_ring_t *ring);
+// Any thread. -1 when the ring is full.
+int nic_ring_enqueue(nic_ring_t *ring, const void *elem);
+// Consumer only, return the number of elements copied out (0 or 1 for dequeue)
+int nic_ring_dequeue(nic_ring_t *ring, void *elem);
+unsigned int nic_ring_dequeue_burst(nic_ring_t *ring, void *elems, unsigned int max);
+// Any thread, claims head with a CAS like enqueue does with tail
+int nic_ring_dequeue_mc(nic_ring_t *ring, void *elem);
+// Consumer only: nothing published at head
+int nic_ring_empty(nic_ring_t *ring);
+// Claimed slots not read yet, a snapshot from any thread
+unsigned int nic_ring_count(nic_ring_t *ring);
+
+#endif
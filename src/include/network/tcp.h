@@ -22,6 +22,9 @@ typedef uint32_t ipv4_addr_t;
 #define TCP_FLAG_ACK 0x10
 #define TCP_FLAG_URG 0x20
 
+// Largest payload handed to the NIC in one TSO super-frame (IPv4 total length is 16 bits)
+#define TCP_GSO_MAX_PAYLOAD (65535 - 20 - 20)
+
 // TCP States
 typedef enum {
     TCP_STATE_CLOSED,
@@ -65,6 +68,8 @@ typedef struct {
     uint32_t seq_num_next;      // Next sequence number to send
     uint32_t ack_num_expected;  // Next acknowledgment number we expect to receive
 
+    nic_device_t* nic;          // Device the listener was opened on
+
     // Buffers for sending and receiving data would go here
     // For a minimal implementation, we might handle data more directly
 
@@ -110,7 +115,7 @@ int tcp_send(nic_device_t* nic, tcb_t* tcb, const void* data, size_t len);
  * @param port The local port to listen on.
  * @return A pointer to the new TCB, or NULL on failure.
  */
-tcb_t* tcp_listen(uint16_t port);
+tcb_t* tcp_listen(nic_device_t* nic, uint16_t port);
 
 /**
  * @brief Closes a TCP connection.
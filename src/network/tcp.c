@@ -1,5 +1,7 @@
 #include "network/tcp.h"
 #include "core/ipv4.h" // <--- MODIFICACION: Incluir para llamar a ipv4_send
+#include "core/checksum.h"
+#include "drivers/interface.h"
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <string.h>
@@ -15,7 +17,9 @@ static tcp_accept_callback_t app_on_accept = NULL;
 static tcp_data_callback_t app_on_data = NULL;
 
 // Forward declaration for internal helper
-static void send_tcp_packet(nic_device_t* nic, tcb_t* tcb, uint8_t flags, const void* data, size_t len);
+static void send_tcp_packet(nic_device_t* nic, tcb_t* tcb, uint8_t flags, const void* data, size_t len, uint16_t gso_size);
+static void tcp_ipv4_input(nic_device_t* nic, uint32_t src_ip, const void* payload, uint16_t len, unsigned int flags);
+static uint16_t tcp_checksum(ipv4_addr_t src_ip, ipv4_addr_t dst_ip, const void* segment, size_t len);
 
 
 /*
@@ -30,6 +34,7 @@ void tcp_init() {
     for (int i = 0; i < MAX_TCP_CONNECTIONS; i++) {
         connection_pool[i].state = TCP_STATE_CLOSED;
     }
+    ipv4_register_protocol_handler(6, tcp_ipv4_input);
     printf("TCP layer initialized.\n");
 }
 
@@ -70,6 +75,19 @@ tcb_t* find_listening_tcb(uint16_t local_port) {
 }
 
 
+// Entry point registered with the IPv4 protocol table (protocol 6). The
+// checksum is verified in software only when the kernel or the NIC has not
+// done it already (and is not verified at all on locally sent frames, whose
+// checksum is still partial).
+static void tcp_ipv4_input(nic_device_t* nic, uint32_t src_ip, const void* payload, uint16_t len, unsigned int flags) {
+    if (!(flags & (HAL_FRAME_CSUM_VALID | HAL_FRAME_CSUM_PARTIAL)) &&
+        tcp_checksum(src_ip, nic->ip_address, payload, len) != 0) {
+        printf("TCP packet with bad checksum dropped.\n");
+        return;
+    }
+    tcp_input(nic, src_ip, (void*)payload, len);
+}
+
 void tcp_input(nic_device_t* nic, ipv4_addr_t src_ip, void* packet, size_t len) {
     if (len < sizeof(tcp_hdr_t)) {
         printf("TCP packet too short.\n");
@@ -78,7 +96,7 @@ void tcp_input(nic_device_t* nic, ipv4_addr_t src_ip, void* packet, size_t len)
 
     tcp_hdr_t* hdr = (tcp_hdr_t*)packet;
     
-    // In a real implementation, checksum would be verified here.
+    // The checksum was verified by tcp_ipv4_input() or by the hardware.
 
     // Find the connection this packet belongs to
     tcb_t* tcb = find_tcb(src_ip, hdr->src_port, hdr->dst_port);
@@ -111,7 +129,7 @@ void tcp_input(nic_device_t* nic, ipv4_addr_t src_ip, void* packet, size_t len)
 
                 // Send SYN-ACK
                 printf("Sending SYN-ACK...\n");
-                send_tcp_packet(nic, tcb, TCP_FLAG_SYN | TCP_FLAG_ACK, NULL, 0);
+                send_tcp_packet(nic, tcb, TCP_FLAG_SYN | TCP_FLAG_ACK, NULL, 0, 0);
 
             }
             break;
@@ -159,13 +177,18 @@ void tcp_input(nic_device_t* nic, ipv4_addr_t src_ip, void* packet, size_t len)
  * ============================================================================
  */
 
-tcb_t* tcp_listen(uint16_t port) {
+tcb_t* tcp_listen(nic_device_t* nic, uint16_t port) {
     for (int i = 0; i < MAX_TCP_CONNECTIONS; i++) {
         if (connection_pool[i].state == TCP_STATE_CLOSED) {
             tcb_t* tcb = &connection_pool[i];
             memset(tcb, 0, sizeof(tcb_t));
             tcb->state = TCP_STATE_LISTEN;
             tcb->local_port = htons(port);
+            tcb->nic = nic;
+            // Let segments for this port through the NIC's kernel-side filter
+            if (nic) {
+                nic_get_driver()->ioctl(nic, NIC_IOCTL_ADD_FILTER_PORT, &port);
+            }
             printf("TCP listening on port %u\n", port);
             return tcb;
         }
@@ -181,6 +204,12 @@ void tcp_close(tcb_t* tcb) {
     // Here we'll just close it abruptly.
     printf("Closing TCP connection.\n");
     tcb->state = TCP_STATE_CLOSED;
+
+    // The port stays open in the filter while another TCB still uses it
+    if (tcb->nic && !find_listening_tcb(tcb->local_port)) {
+        uint16_t port = ntohs(tcb->local_port);
+        nic_get_driver()->ioctl(tcb->nic, NIC_IOCTL_REMOVE_FILTER_PORT, &port);
+    }
 }
 
 
@@ -190,16 +219,37 @@ void tcp_close(tcb_t* tcb) {
  * ============================================================================
  */
 
-// This function now takes the nic device to pass down to the ipv4_send function
-static void send_tcp_packet(nic_device_t* nic, tcb_t* tcb, uint8_t flags, const void* data, size_t len) {
+// One's complement sum of the IPv4 pseudo-header, not folded
+static uint32_t tcp_pseudo_header_sum(ipv4_addr_t src_ip, ipv4_addr_t dst_ip, size_t tcp_len) {
+    uint32_t sum = 0;
+    sum += (src_ip & 0xFFFF) + (src_ip >> 16);
+    sum += (dst_ip & 0xFFFF) + (dst_ip >> 16);
+    sum += htons(6);
+    sum += htons((uint16_t)tcp_len);
+    return sum;
+}
+
+// Full software checksum over pseudo-header + segment
+static uint16_t tcp_checksum(ipv4_addr_t src_ip, ipv4_addr_t dst_ip, const void* segment, size_t len) {
+    return csum_fold(csum_partial(segment, len, tcp_pseudo_header_sum(src_ip, dst_ip, len)));
+}
+
+// This function now takes the nic device to pass down to the ipv4_send function.
+// With gso_size != 0 the payload is sent as one TSO super-frame that the NIC
+// cuts into gso_size byte segments.
+static void send_tcp_packet(nic_device_t* nic, tcb_t* tcb, uint8_t flags, const void* data, size_t len, uint16_t gso_size) {
     size_t tcp_header_size = sizeof(tcp_hdr_t);
     size_t packet_size = tcp_header_size + len;
-    uint8_t* packet = malloc(packet_size);
+    // The segment is written once, into a buffer from the NIC's pool (super-frames
+    // above its data room get a one-off buffer). IPv4 and Ethernet push their
+    // headers into its headroom and the NIC queues it by reference.
+    nic_mbuf_t* mbuf = nic_mbuf_alloc(nic->pool, packet_size);
 
-    if (!packet) {
+    if (!mbuf) {
         printf("Failed to allocate memory for TCP packet.\n");
         return;
     }
+    uint8_t* packet = nic_mbuf_data(mbuf);
 
     tcp_hdr_t* hdr = (tcp_hdr_t*)packet;
     memset(hdr, 0, tcp_header_size);
@@ -212,11 +262,33 @@ static void send_tcp_packet(nic_device_t* nic, tcb_t* tcb, uint8_t flags, const
     hdr->flags = flags;
     hdr->window_size = htons(8192); // Hardcoded window size
     
-    if (data && len > 0) {
-        memcpy(packet + tcp_header_size, data, len);
+    // Checksum: left partial for the NIC when it can finish it, otherwise done
+    // here, summing the payload while it is copied in
+    unsigned int offloads = 0;
+    nic_get_driver()->ioctl(nic, NIC_IOCTL_GET_OFFLOADS, &offloads);
+    hal_offload_t offload;
+    memset(&offload, 0, sizeof(offload));
+    uint32_t sum = tcp_pseudo_header_sum(nic->ip_address, tcb->remote_ip, packet_size);
+    if (offloads & HAL_OFFLOAD_CSUM) {
+        if (data && len > 0) {
+            memcpy(packet + tcp_header_size, data, len);
+        }
+        offload.flags = HAL_OFFLOAD_CSUM;
+        offload.csum_start = 0;
+        offload.csum_offset = offsetof(tcp_hdr_t, checksum);
+        // Folded but not inverted: the NIC adds the segment and inverts
+        hdr->checksum = (uint16_t)~csum_fold(sum);
+    } else {
+        if (data && len > 0) {
+            sum = csum_partial_copy(packet + tcp_header_size, data, len, sum);
+        }
+        hdr->checksum = csum_fold(csum_partial(hdr, tcp_header_size, sum));
+    }
+    if (gso_size && len > gso_size) {
+        offload.flags |= HAL_OFFLOAD_TSO4;
+        offload.gso_size = gso_size;
+        offload.hdr_len = tcp_header_size;
     }
-    
-    // Checksum calculation would go here.
 
     printf("Attempting to send TCP packet (flags: 0x%02X) via IPv4...\n", flags);
     
@@ -224,12 +296,10 @@ static void send_tcp_packet(nic_device_t* nic, tcb_t* tcb, uint8_t flags, const
      * INICIO DE LA MODIFICACION: Reemplazo del STUB por la llamada a ipv4_send
      ****************************************************************************/
     // El protocolo 6 es TCP
-    ipv4_send(nic, tcb->remote_ip, 6, packet, packet_size);
+    ipv4_send_mbuf(nic, tcb->remote_ip, 6, mbuf, &offload);
     /****************************************************************************
      * FIN DE LA MODIFICACION
      ****************************************************************************/
-
-    free(packet);
 }
 
 int tcp_send(nic_device_t* nic, tcb_t* tcb, const void* data, size_t len) {
@@ -238,10 +308,25 @@ int tcp_send(nic_device_t* nic, tcb_t* tcb, const void* data, size_t len) {
         return -1;
     }
 
-    send_tcp_packet(nic, tcb, TCP_FLAG_ACK | TCP_FLAG_PSH, data, len);
-    
-    // A real implementation would wait for an ACK and handle retransmissions.
-    tcb->seq_num_next += len;
+    // Payloads above the MSS go down as TSO super-frames when the NIC can
+    // segment them, otherwise they are cut here
+    size_t mss = nic->mtu - sizeof(struct ipv4_header) - sizeof(tcp_hdr_t);
+    size_t max_chunk = mss;
+    unsigned int offloads = 0;
+    nic_get_driver()->ioctl(nic, NIC_IOCTL_GET_OFFLOADS, &offloads);
+    if ((offloads & HAL_OFFLOAD_TSO4) && (offloads & HAL_OFFLOAD_CSUM)) {
+        max_chunk = TCP_GSO_MAX_PAYLOAD;
+    }
+
+    size_t offset = 0;
+    do {
+        size_t chunk = len - offset < max_chunk ? len - offset : max_chunk;
+        send_tcp_packet(nic, tcb, TCP_FLAG_ACK | TCP_FLAG_PSH, (const uint8_t*)data + offset, chunk,
+                        chunk > mss ? (uint16_t)mss : 0);
+        // A real implementation would wait for an ACK and handle retransmissions.
+        tcb->seq_num_next += chunk;
+        offset += chunk;
+    } while (offset < len);
 
     return 0;
 }